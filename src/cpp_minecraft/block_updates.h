@@ -0,0 +1,159 @@
+#pragma once
+
+#include "voxels.h"
+
+#include <algorithm>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+// Simulation period of water and lava, in seconds.
+static constexpr float kBlockTickPeriod = 0.3f;
+
+static bool IsFluid (Block v)
+{
+    return v == eWater || v == eLava;
+}
+
+// Offsets of the voxels the fluid rule of a cell reads: the cell below, the four horizontal
+// neighbours and the cells below those.
+static glm::ivec3 const g_fluidReadOffsets [] =
+{
+    { 0, -1,  0},
+    { 0,  0, -1}, { 0, -1, -1},
+    { 0,  0,  1}, { 0, -1,  1},
+    {-1,  0,  0}, {-1, -1,  0},
+    { 1,  0,  0}, { 1, -1,  0},
+};
+
+// Fluid does not flow below the world floor: everything under y = 0 counts as solid.
+static constexpr int kWorldFloor = 0;
+
+// Every chunk may be written.
+struct AllResident
+{
+    bool operator() (glm::ivec3 const&) const {return true;}
+};
+
+// Append the writes fluid v at p makes in one tick: it falls into air below it and spreads
+// sideways into air that has something underneath. Returns the number of writes. Chunks for
+// which resident(key) is false, e.g. not streamed in yet, count as solid: they read as air
+// until they arrive, and writes into them would be overwritten when they do.
+template<class Resident = AllResident>
+int FluidWrites (Voxels const& grid, glm::ivec3 const& p, Block v, std::vector<std::pair<glm::ivec3, Block>>& writes,
+                 Resident const& resident = Resident())
+{
+    auto air_at = [&](int dx, int dy, int dz)
+    {
+        glm::ivec3 q = p + glm::ivec3(dx, dy, dz);
+        return q.y >= kWorldFloor && resident(Voxels::ChunkOf(q)) && grid.Get(q) == eAir;
+    };
+    size_t n = writes.size();
+
+    if(air_at(0, -1, 0))
+        writes.emplace_back(p + glm::ivec3(0, -1, 0), v);
+
+    if(air_at(0, 0, -1) && !air_at(0, -1, -1))
+        writes.emplace_back(p + glm::ivec3(0, 0, -1), v);
+
+    if(air_at(0, 0, 1) && !air_at(0, -1, 1))
+        writes.emplace_back(p + glm::ivec3(0, 0, 1), v);
+
+    if(air_at(-1, 0, 0) && !air_at(-1, -1, 0))
+        writes.emplace_back(p + glm::ivec3(-1, 0, 0), v);
+
+    if(air_at(1, 0, 0) && !air_at(1, -1, 0))
+        writes.emplace_back(p + glm::ivec3(1, 0, 0), v);
+
+    return writes.size() - n;
+}
+
+// Schedules block updates on a fixed timestep. Only cells in the active set are ticked. A cell
+// whose tick writes nothing has settled and drops out of the set; it is woken again when a
+// voxel its rule reads changes. Cost per tick is proportional to the number of active cells,
+// not to the size of the world.
+struct BlockUpdates
+{
+    std::unordered_set<glm::ivec3, ChunkHash> active;
+
+    // Wake every cell whose update depends on voxel p, i.e. p itself and the fluid cells that
+    // read it. Call this for every voxel that changes.
+    void WakeAround (glm::ivec3 const& p)
+    {
+        active.insert(p);
+        for(auto const& o: g_fluidReadOffsets)
+            active.insert(p - o);
+    }
+
+    // Wake the fluid in and around the box [lo, hi] (inclusive) after a bulk edit changed voxels
+    // in it. The cells that read a voxel of the box are at most one voxel beside or above it.
+    void WakeBox (Voxels const& grid, glm::ivec3 const& lo, glm::ivec3 const& hi)
+    {
+        for(int z = lo.z - 1; z <= hi.z + 1; ++z)
+            for(int y = lo.y; y <= hi.y + 1; ++y)
+                for(int x = lo.x - 1; x <= hi.x + 1; ++x)
+                    if(IsFluid(grid.Get(x, y, z)))
+                        active.insert({x, y, z});
+    }
+
+    // Activate the fluid in chunk key, e.g. after it was generated or loaded, and the fluid beside
+    // and above it, which may have been held back while the chunk was not resident. Chunks whose
+    // palette holds no fluid are skipped without looking at their voxels.
+    void WakeChunk (Voxels const& grid, glm::ivec3 const& key)
+    {
+        auto has_fluid = [&](glm::ivec3 const& k)
+        {
+            Chunk const* c = grid.FindChunk(k);
+            return c && std::any_of(c->palette.begin(), c->palette.end(), IsFluid);
+        };
+
+        glm::ivec3 origin = key * kChunkDim;
+        if(has_fluid(key))
+        {
+            Chunk const& chunk = *grid.FindChunk(key);
+            for(int lz = 0; lz < kChunkDim; ++lz)
+                for(int ly = 0; ly < kChunkDim; ++ly)
+                    for(int lx = 0; lx < kChunkDim; ++lx)
+                        if(IsFluid(chunk.Get(lx, ly, lz)))
+                            active.insert(origin + glm::ivec3(lx, ly, lz));
+        }
+
+        for(int dz = -1; dz <= 1; ++dz)
+            for(int dy = 0; dy <= 1; ++dy)
+                for(int dx = -1; dx <= 1; ++dx)
+                    if((dx || dy || dz) && has_fluid(key + glm::ivec3(dx, dy, dz)))
+                    {
+                        WakeBox(grid, origin, origin + (kChunkDim - 1));
+                        return;
+                    }
+    }
+
+    // Run one tick. Reads see the world as it was before the tick. The writes are appended to
+    // changes in a deterministic order (chunk, then voxel, z-major), and the active set is
+    // emptied. Committing the changes with WakeAround as the callback schedules the next tick.
+    // Fluid does not flow into chunks for which resident(key) is false (see FluidWrites).
+    template<class Resident = AllResident>
+    void Tick (Voxels const& grid, VoxelChanges& changes, Resident const& resident = Resident())
+    {
+        ticked.assign(active.begin(), active.end());
+        active.clear();
+        std::sort(ticked.begin(), ticked.end(), [](glm::ivec3 const& a, glm::ivec3 const& b)
+        {
+            glm::ivec3 ka = Voxels::ChunkOf(a), kb = Voxels::ChunkOf(b);
+            if(ka != kb)
+                return std::make_tuple(ka.z, ka.y, ka.x) < std::make_tuple(kb.z, kb.y, kb.x);
+            return std::make_tuple(a.z, a.y, a.x) < std::make_tuple(b.z, b.y, b.x);
+        });
+
+        for(auto const& p: ticked)
+        {
+            Block v = grid.Get(p);
+            if(IsFluid(v))
+                FluidWrites(grid, p, v, changes.writes, resident);
+        }
+    }
+
+private:
+    // Scratch list of the cells ticked, kept to reuse its capacity.
+    std::vector<glm::ivec3> ticked;
+};
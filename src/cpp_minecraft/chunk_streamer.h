@@ -0,0 +1,427 @@
+#pragma once
+
+#include "voxels.h"
+#include "lighting.h"
+#include "visibility.h"
+#include "lod.h"
+#include "world_store.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Streams the chunks around the player in and out of a Voxels. Chunks are loaded from the
+// WorldStore, or generated if they were never saved, and meshed on a pool of worker threads.
+// The main thread only hands out jobs and picks up finished ones, so it never waits on the
+// generator, the disk or the mesher.
+class ChunkStreamer
+{
+public:
+    // Fills an empty chunk with the terrain of chunk key. Called from the worker threads.
+    using Generator = std::function<void (glm::ivec3 const& key, Chunk& chunk)>;
+
+    struct MeshResult
+    {
+        glm::ivec3 key;
+        int level;             // Level of detail, see lod.h. 0 for full detail chunks.
+        uint64_t generation;
+        std::vector<VoxelVertex> points;
+        uint16_t connectivity; // FaceConnectivity of the chunk meshed.
+    };
+
+    int load_radius = 6;            // Horizontal distance in chunks within which chunks are loaded.
+    int unload_radius = 8;          // Chunks further than this may be evicted...
+    size_t memory_budget = 64 << 20; // ...while the voxel data takes more bytes than this.
+    int y_min = 0, y_max = 1;       // Range of chunk layers that are streamed.
+
+private:
+    struct LoadJob
+    {
+        float priority;
+        glm::ivec3 key;
+    };
+
+    struct MeshJob
+    {
+        float priority;
+        glm::ivec3 key;
+        int level;
+        uint64_t generation;
+        bool greedy;
+        std::unique_ptr<Voxels> snapshot; // The chunk, and its face neighbours at full detail.
+        std::unique_ptr<LightNeighbourhood> light; // Null for meshes without lighting.
+    };
+
+    struct LoadResult
+    {
+        glm::ivec3 key;
+        bool generated;
+        std::unique_ptr<Chunk> chunk;
+    };
+
+    // Heaps with the lowest priority value on top.
+    template<typename Job>
+    static bool Later (Job const& a, Job const& b)
+    {
+        return a.priority > b.priority;
+    }
+
+    WorldStore& store_;
+    Generator generate_;
+
+    // Main thread only.
+    std::unordered_set<glm::ivec3, ChunkHash> resident_;                 // Loaded, including all-air chunks.
+    // Latest mesh request per chunk, by level of detail.
+    std::unordered_map<glm::ivec3, uint64_t, ChunkHash> mesh_generation_[kNumLodLevels + 1];
+    uint64_t next_generation_ = 0;
+
+    // Shared with the workers, guarded by mutex_.
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<LoadJob> load_queue_;
+    std::vector<MeshJob> mesh_queue_;
+    std::unordered_set<glm::ivec3, ChunkHash> loading_; // Queued or being loaded.
+    std::vector<LoadResult> loaded_;
+    std::vector<MeshResult> meshed_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+
+public:
+    ChunkStreamer (WorldStore& store, Generator generate, int num_threads = 0)
+        : store_(store), generate_{generate}
+    {
+        if(num_threads <= 0)
+            num_threads = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+        for(int i = 0; i < num_threads; ++i)
+            workers_.emplace_back(&ChunkStreamer::WorkLoop, this);
+    }
+
+    // Jobs still queued are dropped.
+    ~ChunkStreamer ()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for(auto& w: workers_)
+            w.join();
+    }
+
+    bool IsResident (glm::ivec3 const& key) const
+    {
+        return resident_.count(key) != 0;
+    }
+
+    // Call once per frame from the main thread. center is the player position and view_dir the
+    // direction they look in, both in voxel units.
+    //  - Chunks finished since the last call are added to grid. They and their neighbours are
+    //    marked dirty and their keys appended to loaded, if given, including those of all-air
+    //    chunks, which take no space in grid. Generated chunks are marked unsaved so the next
+    //    save writes them.
+    //  - The missing chunks within load_radius are queued, nearest first and those in view
+    //    before those behind. The queue is rebuilt each call, so it follows the player.
+    //  - While over the memory budget, chunks beyond unload_radius are saved and evicted,
+    //    furthest first. All-air chunks beyond it are forgotten right away. The keys of both
+    //    are appended to unloaded, if given.
+    void Update (Voxels& grid, glm::vec3 const& center, glm::vec3 const& view_dir,
+                 std::vector<glm::ivec3>* loaded = nullptr, std::vector<glm::ivec3>* unloaded = nullptr)
+    {
+        std::vector<LoadResult> results;
+        glm::ivec3 center_key = Voxels::ChunkOf(glm::ivec3(glm::floor(center)));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            results.swap(loaded_);
+            for(auto const& r: results)
+                loading_.erase(r.key);
+
+            // Requeue from scratch. Chunks already being loaded are left alone.
+            for(auto const& job: load_queue_)
+                loading_.erase(job.key);
+            load_queue_.clear();
+            for(int cz = center_key.z - load_radius; cz <= center_key.z + load_radius; ++cz)
+                for(int cx = center_key.x - load_radius; cx <= center_key.x + load_radius; ++cx)
+                    for(int cy = y_min; cy <= y_max; ++cy)
+                    {
+                        glm::ivec3 key(cx, cy, cz);
+                        int dx = cx - center_key.x, dz = cz - center_key.z;
+                        if(dx * dx + dz * dz > load_radius * load_radius || resident_.count(key) || loading_.count(key))
+                            continue;
+                        load_queue_.push_back({Priority(key, center, view_dir), key});
+                        loading_.insert(key);
+                    }
+            std::make_heap(load_queue_.begin(), load_queue_.end(), Later<LoadJob>);
+        }
+        cv_.notify_all();
+
+        for(auto& r: results)
+            Insert(grid, r, loaded);
+
+        Evict(grid, center_key, unloaded);
+    }
+
+    // Load the missing chunks within load_radius of center right away, in parallel, e.g. so that
+    // the player has ground under their feet on the first frame. Returns how many were loaded.
+    int LoadNow (Voxels& grid, glm::vec3 const& center, std::vector<glm::ivec3>* loaded = nullptr)
+    {
+        glm::ivec3 center_key = Voxels::ChunkOf(glm::ivec3(glm::floor(center)));
+        std::vector<LoadResult> results;
+        for(int cz = center_key.z - load_radius; cz <= center_key.z + load_radius; ++cz)
+            for(int cx = center_key.x - load_radius; cx <= center_key.x + load_radius; ++cx)
+                for(int cy = y_min; cy <= y_max; ++cy)
+                {
+                    int dx = cx - center_key.x, dz = cz - center_key.z;
+                    if(dx * dx + dz * dz <= load_radius * load_radius && !resident_.count({cx, cy, cz}))
+                        results.push_back({glm::ivec3(cx, cy, cz), false, nullptr});
+                }
+
+        #pragma omp parallel for schedule(dynamic)
+        for(int i = 0; i < (int)results.size(); ++i)
+            results[i] = Load(results[i].key);
+
+        for(auto& r: results)
+            Insert(grid, r, loaded);
+        return results.size();
+    }
+
+    // Queue a remesh of chunk key of grid. The worker meshes a copy of the chunk and its face
+    // neighbours, and of the light around it if lighting is given, so grid may change in the
+    // meantime. Results of earlier requests for the same chunk are dropped.
+    void RequestMesh (Voxels const& grid, glm::ivec3 const& key, bool greedy, float priority, Lighting const* lighting = nullptr)
+    {
+        std::unique_ptr<Voxels> snapshot(new Voxels);
+        for(int face = -1; face < 6; ++face)
+        {
+            glm::ivec3 k = key;
+            if(face >= 0)
+                k[face / 2] += (face & 1) ? 1 : -1;
+            if(Chunk const* c = grid.FindChunk(k))
+                snapshot->GetOrCreateChunk(k) = *c;
+        }
+        std::unique_ptr<LightNeighbourhood> light;
+        if(lighting)
+        {
+            light.reset(new LightNeighbourhood);
+            lighting->Gather(grid, key, *light);
+        }
+
+        QueueMesh({priority, key, 0, 0, greedy, std::move(snapshot), std::move(light)});
+    }
+
+    // Queue a remesh of chunk key of the grid of a level of detail. The chunk is meshed on its
+    // own, as if its neighbours were air, so the mesh is closed at the chunk border: where it
+    // meets chunks of another level, which do not line up with its voxels, the border faces
+    // cover the seam instead of leaving cracks. It is not lit.
+    void RequestLodMesh (Voxels const& lod_grid, glm::ivec3 const& key, int level, bool greedy, float priority)
+    {
+        std::unique_ptr<Voxels> snapshot(new Voxels);
+        if(Chunk const* c = lod_grid.FindChunk(key))
+            snapshot->GetOrCreateChunk(key) = *c;
+        QueueMesh({priority, key, level, 0, greedy, std::move(snapshot), nullptr});
+    }
+
+    // Forget pending mesh requests for chunk key of level, e.g. because it was removed.
+    void DropMesh (glm::ivec3 const& key, int level = 0)
+    {
+        mesh_generation_[level].erase(key);
+    }
+
+    // Move the meshes finished since the last call into out, skipping outdated ones.
+    void TakeMeshes (std::vector<MeshResult>& out)
+    {
+        std::vector<MeshResult> results;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            results.swap(meshed_);
+        }
+        for(auto& r: results)
+        {
+            auto& generations = mesh_generation_[r.level];
+            auto it = generations.find(r.key);
+            if(it == generations.end() || it->second != r.generation)
+                continue;
+            generations.erase(it);
+            out.push_back(std::move(r));
+        }
+    }
+
+    // Number of mesh requests not picked up yet.
+    size_t PendingMeshes () const
+    {
+        size_t n = 0;
+        for(auto const& generations: mesh_generation_)
+            n += generations.size();
+        return n;
+    }
+
+    // Priority of chunk key, lower first: its distance from center, halved for chunks straight
+    // ahead and increased by half for those behind.
+    static float Priority (glm::ivec3 const& key, glm::vec3 const& center, glm::vec3 const& view_dir)
+    {
+        glm::vec3 d = (glm::vec3(key) + 0.5f) * float(kChunkDim) - center;
+        float dist = glm::length(d);
+        float facing = dist > 0 ? glm::dot(d, view_dir) / (dist * std::max(glm::length(view_dir), 1e-6f)) : 1;
+        return dist * (1 - 0.5f * facing);
+    }
+
+private:
+    // Load chunk key from the store, or generate it if it was never saved.
+    LoadResult Load (glm::ivec3 const& key)
+    {
+        LoadResult r{key, false, std::unique_ptr<Chunk>(new Chunk)};
+        if(!store_.LoadChunk(key, *r.chunk))
+        {
+            generate_(key, *r.chunk);
+            r.generated = true;
+        }
+        return r;
+    }
+
+    // Hand a mesh job to the workers as the latest request for its chunk.
+    void QueueMesh (MeshJob job)
+    {
+        job.generation = mesh_generation_[job.level][job.key] = ++next_generation_;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            mesh_queue_.push_back(std::move(job));
+            std::push_heap(mesh_queue_.begin(), mesh_queue_.end(), Later<MeshJob>);
+        }
+        cv_.notify_one();
+    }
+
+    // Add a loaded chunk to grid and mark it and its neighbours dirty. Generated chunks are marked
+    // unsaved. Nothing writes to a chunk before it is resident, so the grid holds none for key.
+    void Insert (Voxels& grid, LoadResult& r, std::vector<glm::ivec3>* loaded)
+    {
+        if(resident_.count(r.key))
+            return;
+        resident_.insert(r.key);
+        if(r.chunk->solid_count == 0)
+        {
+            if(loaded)
+                loaded->push_back(r.key);
+            return;
+        }
+        std::swap(grid.GetOrCreateChunk(r.key), *r.chunk);
+        if(r.generated)
+            grid.unsaved_chunks.insert(r.key);
+        grid.dirty_chunks.insert(r.key);
+        for(int face = 0; face < 6; ++face)
+        {
+            glm::ivec3 nb = r.key;
+            nb[face / 2] += (face & 1) ? 1 : -1;
+            grid.dirty_chunks.insert(nb);
+        }
+        if(loaded)
+            loaded->push_back(r.key);
+    }
+
+    void Evict (Voxels& grid, glm::ivec3 const& center_key, std::vector<glm::ivec3>* unloaded)
+    {
+        auto beyond = [&](glm::ivec3 const& key)
+        {
+            int dx = key.x - center_key.x, dz = key.z - center_key.z;
+            return dx * dx + dz * dz > unload_radius * unload_radius;
+        };
+
+        // All-air chunks cost nothing but their entry here, so forget them right away.
+        std::vector<std::pair<int, glm::ivec3>> far;
+        for(auto it = resident_.begin(); it != resident_.end();)
+        {
+            if(!beyond(*it))
+                ++it;
+            else if(!grid.FindChunk(*it))
+            {
+                if(unloaded)
+                    unloaded->push_back(*it);
+                it = resident_.erase(it);
+            }
+            else
+            {
+                glm::ivec3 d = *it - center_key;
+                far.emplace_back(d.x * d.x + d.z * d.z, *it);
+                ++it;
+            }
+        }
+        if(far.empty())
+            return;
+        size_t bytes = grid.MemoryBytes();
+        if(bytes <= memory_budget)
+            return;
+
+        // Write out edits before the chunks are dropped.
+        store_.SaveAsync(grid);
+        std::sort(far.begin(), far.end(), [](std::pair<int, glm::ivec3> const& a, std::pair<int, glm::ivec3> const& b)
+        {
+            return a.first > b.first;
+        });
+        for(auto const& f: far)
+        {
+            if(bytes <= memory_budget)
+                break;
+            auto it = grid.chunks.find(f.second);
+            bytes -= it->second.MemoryBytes();
+            grid.chunks.erase(it);
+            resident_.erase(f.second);
+            if(unloaded)
+                unloaded->push_back(f.second);
+            // Lets the owner of the meshes drop this one.
+            grid.dirty_chunks.insert(f.second);
+        }
+    }
+
+    void WorkLoop ()
+    {
+        while(true)
+        {
+            MeshJob mesh_job;
+            LoadJob load_job;
+            bool is_mesh;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] {return stop_ || !mesh_queue_.empty() || !load_queue_.empty();});
+                if(stop_)
+                    return;
+                // Meshes of loaded chunks are quick and visible, so they go first.
+                is_mesh = !mesh_queue_.empty();
+                if(is_mesh)
+                {
+                    std::pop_heap(mesh_queue_.begin(), mesh_queue_.end(), Later<MeshJob>);
+                    mesh_job = std::move(mesh_queue_.back());
+                    mesh_queue_.pop_back();
+                }
+                else
+                {
+                    std::pop_heap(load_queue_.begin(), load_queue_.end(), Later<LoadJob>);
+                    load_job = load_queue_.back();
+                    load_queue_.pop_back();
+                }
+            }
+
+            if(is_mesh)
+            {
+                Chunk const* chunk = mesh_job.snapshot->FindChunk(mesh_job.key);
+                MeshResult r{mesh_job.key, mesh_job.level, mesh_job.generation, {},
+                             chunk && mesh_job.level == 0 ? FaceConnectivity(*chunk) : kAllFacesConnected};
+                if(mesh_job.light)
+                    Voxelize(*mesh_job.snapshot, mesh_job.key, r.points, mesh_job.greedy, *mesh_job.light);
+                else
+                    Voxelize(*mesh_job.snapshot, mesh_job.key, r.points, mesh_job.greedy);
+                std::lock_guard<std::mutex> lock(mutex_);
+                meshed_.push_back(std::move(r));
+            }
+            else
+            {
+                LoadResult r = Load(load_job.key);
+                std::lock_guard<std::mutex> lock(mutex_);
+                loaded_.push_back(std::move(r));
+            }
+        }
+    }
+};
@@ -27,36 +27,125 @@ void Curve::Render ()
     Unbind(m_vao);
 }
 
+template<class Buffer>
+void GrowableBuffer<Buffer>::Write (void const* data, size_t size, size_t begin, size_t end)
+{
+    if(size > m_capacity)
+    {
+        // Fresh storage holds nothing yet, so all of the data is uploaded.
+        m_capacity = std::max(size, 2 * m_capacity);
+        m_buffer.data(m_capacity, nullptr, gl::BufferUsage::kDynamicDraw);
+        begin = 0;
+        end = size;
+    }
+    if(begin >= end)
+        return;
+
+    m_buffer.subData(begin, end - begin, static_cast<char const*>(data) + begin);
+    g_uploadStats.bytes += end - begin;
+    ++g_uploadStats.uploads;
+}
+
 Mesh::Mesh () 
 {
-    // Create positions vertex attribute pointer.
     m_points = nullptr;
     m_indices = nullptr;
+    m_vao_ready = false;
+    m_dirty = false;
 }
 
 void Mesh::UpdateVao () 
 {
     // Set indices data.
     Bind(m_vao);
-    Bind(m_buffer);
-    Bind(m_ind_buffer);
-    size_t stride = sizeof(MeshPoint);
-    gl::VertexAttrib(0).pointer(3, gl::DataType::kFloat, false, stride, nullptr).enable();
-    gl::VertexAttrib(1).pointer(3, gl::DataType::kFloat, false, stride, (void*)(sizeof(float)*3)).enable();
-    gl::VertexAttrib(2).pointer(2, gl::DataType::kFloat, false, stride, (void*)(sizeof(float)*6)).enable();
-    gl::VertexAttrib(3).pointer(3, gl::DataType::kFloat, false, stride, (void*)(sizeof(float)*8)).enable();
-    m_buffer.data(*m_points);
-    m_ind_buffer.data(*m_indices);
-    Unbind(m_ind_buffer);
-    Unbind(m_buffer);
+    Bind(m_buffer.Get());
+    Bind(m_ind_buffer.Get());
+    if(!m_vao_ready)
+    {
+        // The attribute pointers stay valid when the buffer storage is reallocated.
+        size_t stride = sizeof(MeshPoint);
+        gl::VertexAttrib(0).pointer(3, gl::DataType::kFloat, false, stride, nullptr).enable();
+        gl::VertexAttrib(1).pointer(3, gl::DataType::kFloat, false, stride, (void*)(sizeof(float)*3)).enable();
+        gl::VertexAttrib(2).pointer(2, gl::DataType::kFloat, false, stride, (void*)(sizeof(float)*6)).enable();
+        gl::VertexAttrib(3).pointer(3, gl::DataType::kFloat, false, stride, (void*)(sizeof(float)*8)).enable();
+        m_vao_ready = true;
+    }
+    size_t points_size = m_points->size() * sizeof(MeshPoint);
+    size_t indices_size = m_indices->size() * sizeof(unsigned);
+    m_buffer.Write(m_points->data(), points_size, 0, points_size);
+    m_ind_buffer.Write(m_indices->data(), indices_size, 0, indices_size);
+    Unbind(m_ind_buffer.Get());
+    Unbind(m_buffer.Get());
     Unbind(m_vao);
+    m_dirty = false;
 }
 
 void Mesh::Render () 
 {
+    if(m_dirty)
+        UpdateVao();
+
     Bind(m_vao);
-    Bind(m_ind_buffer);
+    Bind(m_ind_buffer.Get());
     gl::DrawElements(gl::PrimType::kTriangles, m_indices->size(), gl::IndexType::kUnsignedInt);
-    Unbind(m_ind_buffer);
+    Unbind(m_ind_buffer.Get());
+    Unbind(m_vao);
+}
+
+void QuadIndexBuffer::Reserve (size_t num_quads)
+{
+    if(num_quads <= m_num_quads)
+        return;
+
+    // Grow geometrically so repeated remeshing does not keep re-uploading.
+    m_num_quads = std::max(num_quads, 2 * m_num_quads);
+    std::vector<unsigned> indices(m_num_quads * 6);
+    unsigned inds_single[6]{0, 1, 2, 2, 3, 0};
+    for(size_t i = 0; i < m_num_quads; ++i)
+        for(int j = 0; j < 6; ++j)
+            indices[i * 6 + j] = i * 4 + inds_single[j];
+
+    Bind(m_buffer);
+    m_buffer.data(indices);
+    Unbind(m_buffer);
+    g_uploadStats.bytes += indices.size() * sizeof(unsigned);
+    ++g_uploadStats.uploads;
+}
+
+VoxelMesh::VoxelMesh ()
+{
+    m_points = nullptr;
+    m_quad_indices = nullptr;
+    m_vao_ready = false;
+    m_dirty_begin = m_dirty_end = 0;
+}
+
+void VoxelMesh::UpdateVao ()
+{
+    Bind(m_vao);
+    Bind(m_buffer.Get());
+    if(!m_vao_ready)
+    {
+        gl::VertexAttrib(0).ipointer(2, gl::WholeDataType::kUnsignedInt, sizeof(VoxelVertex), nullptr).enable();
+        m_vao_ready = true;
+    }
+    m_buffer.Write(m_points->data(), m_points->size() * sizeof(VoxelVertex),
+                   m_dirty_begin * sizeof(VoxelVertex), m_dirty_end * sizeof(VoxelVertex));
+    Unbind(m_buffer.Get());
+    Unbind(m_vao);
+    m_dirty_begin = m_dirty_end = 0;
+}
+
+void VoxelMesh::Render ()
+{
+    if(m_dirty_begin < m_dirty_end)
+        UpdateVao();
+    if(m_points->empty())
+        return;
+
+    Bind(m_vao);
+    Bind(m_quad_indices->Buffer());
+    gl::DrawElements(gl::PrimType::kTriangles, m_points->size() / 4 * 6, gl::IndexType::kUnsignedInt);
+    Unbind(m_quad_indices->Buffer());
     Unbind(m_vao);
 }
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <set>
+#include <algorithm>
 #include <vector>
+#include <cstdint>
 #include <oglwrap/buffer.h>
 #include <oglwrap/context.h>
 #include <oglwrap/vertex_array.h>
@@ -22,29 +24,156 @@ struct MeshPoint
     {}
 };
 
+// Per-vertex shading of voxel meshes, 10 bits: ambient occlusion (2 bits, 3 = unoccluded) |
+// sunlight (4) | block light (4).
+constexpr uint32_t kFullShade = 3 | 15 << 2; // Full sunlight, no block light, unoccluded.
+
+// Packed 8 byte vertex used for voxel chunk meshes, decoded in the voxel vertex shader.
+//   a: x (6 bits) | y (6) | z (6) | face (3) | shade (10)   Position is local to the chunk, in [0, 32].
+//   b: u (6 bits) | v (6) | sprite id (10)                  UV in voxels, so greedy quads can span up to 32.
+// The face index (LEFT, RIGHT, BOTTOM, TOP, BACK, FRONT) selects the normal.
+struct VoxelVertex
+{
+    uint32_t a;
+    uint32_t b;
+    VoxelVertex () = default;
+    VoxelVertex (int x, int y, int z, int face, int u, int v, int sprite, uint32_t shade = kFullShade)
+        : a(uint32_t(x) | uint32_t(y) << 6 | uint32_t(z) << 12 | uint32_t(face) << 18 | shade << 21),
+          b(uint32_t(u) | uint32_t(v) << 6 | uint32_t(sprite) << 12)
+    {}
+};
+
+/// Bytes and writes uploaded to GPU buffers by the meshes, e.g. to report them per frame.
+struct UploadStats
+{
+    size_t bytes = 0;
+    size_t uploads = 0;
+};
+
+UploadStats g_uploadStats;
+
+/// GPU buffer (gl::ArrayBuffer or gl::IndexBuffer) that keeps its storage when the data changes.
+/// The storage grows geometrically, so new data is written into it with sub-range updates, and
+/// only now and then reallocated and uploaded whole.
+template<class Buffer>
+class GrowableBuffer
+{
+private:
+    Buffer m_buffer;
+    size_t m_capacity;
+
+public:
+    GrowableBuffer () : m_capacity{0} {}
+
+    Buffer& Get () {return m_buffer;}
+
+    /// Write the size bytes at data, of which only bytes [begin, end) differ from the last write.
+    /// The buffer must be bound.
+    void Write (void const* data, size_t size, size_t begin, size_t end);
+};
+
 class Mesh 
 {
 private:
     std::vector<MeshPoint>* m_points;
     std::vector<unsigned>* m_indices;
     gl::VertexArray m_vao;
-    gl::ArrayBuffer m_buffer;
-    gl::IndexBuffer m_ind_buffer;
+    GrowableBuffer<gl::ArrayBuffer> m_buffer;
+    GrowableBuffer<gl::IndexBuffer> m_ind_buffer;
+    bool m_vao_ready;
+    bool m_dirty;
 
     void UpdateVao ();
 
 public:
     Mesh ();
 
-    /// Render the mesh.
+    /// Render the mesh, uploading it first if it changed.
     void Render();
 
-    /// Set positions.
+    /// Set positions. They are uploaded by the next Render. Setting the same vectors again
+    /// uploads nothing.
     void Set (std::vector<MeshPoint>* points, std::vector<unsigned>* indices)
     {
+        if(points == m_points && indices == m_indices)
+            return;
         m_points = points;
         m_indices = indices;
-        UpdateVao ();
+        m_dirty = true;
+    }
+};
+
+/// Index buffer for meshes made only of quads (4 vertices each, drawn as 2 triangles).
+/// The index pattern is the same for every quad, so one buffer is shared by all voxel meshes.
+class QuadIndexBuffer
+{
+private:
+    gl::IndexBuffer m_buffer;
+    size_t m_num_quads;
+
+public:
+    QuadIndexBuffer () : m_num_quads{0} {}
+
+    /// Make sure indices for at least num_quads quads are uploaded.
+    void Reserve (size_t num_quads);
+
+    gl::IndexBuffer& Buffer () {return m_buffer;}
+};
+
+/// Mesh of packed voxel vertices. Only the vertices are uploaded per mesh, 
+/// the indices come from a shared QuadIndexBuffer.
+class VoxelMesh
+{
+private:
+    std::vector<VoxelVertex>* m_points;
+    QuadIndexBuffer* m_quad_indices;
+    gl::VertexArray m_vao;
+    GrowableBuffer<gl::ArrayBuffer> m_buffer;
+    bool m_vao_ready;
+    size_t m_dirty_begin, m_dirty_end; // Vertices not uploaded yet, none if begin >= end.
+
+    void UpdateVao ();
+
+public:
+    VoxelMesh ();
+
+    /// Render the mesh, uploading it first if it changed.
+    void Render();
+
+    /// Set vertices, uploaded by the next Render. Every 4 consecutive vertices form a quad.
+    /// If previous holds the vertices of the last Set, only the range that differs from them
+    /// is uploaded.
+    void Set (std::vector<VoxelVertex>* points, QuadIndexBuffer* quad_indices,
+              std::vector<VoxelVertex> const* previous = nullptr)
+    {
+        m_points = points;
+        m_quad_indices = quad_indices;
+        m_quad_indices->Reserve(m_points->size() / 4);
+
+        // A remesh after an edit or a light change usually only touches the faces near it. The
+        // vertices after the change keep their place only if the count did not change.
+        size_t begin = 0, end = points->size();
+        if(previous)
+        {
+            auto same = [&](size_t i)
+            {
+                return (*points)[i].a == (*previous)[i].a && (*points)[i].b == (*previous)[i].b;
+            };
+            size_t n = std::min(points->size(), previous->size());
+            while(begin < n && same(begin))
+                ++begin;
+            if(previous->size() == points->size())
+                while(end > begin && same(end - 1))
+                    --end;
+        }
+        // Sets since the last Render add up, as each diff is against the one before it.
+        if(m_dirty_begin < m_dirty_end)
+        {
+            begin = std::min(begin, m_dirty_begin);
+            end = std::min(std::max(end, m_dirty_end), points->size());
+        }
+        m_dirty_begin = begin;
+        m_dirty_end = end;
     }
 };
 
@@ -0,0 +1,291 @@
+#pragma once
+
+#include "voxels.h"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Bounding box of the voxels an edit changed, inclusive. Empty if nothing changed.
+struct EditBounds
+{
+    glm::ivec3 lo{std::numeric_limits<int>::max()};
+    glm::ivec3 hi{std::numeric_limits<int>::min()};
+
+    bool Empty () const
+    {
+        return lo.x > hi.x;
+    }
+
+    void Add (glm::ivec3 const& b_lo, glm::ivec3 const& b_hi)
+    {
+        lo = glm::min(lo, b_lo);
+        hi = glm::max(hi, b_hi);
+    }
+
+    void Add (EditBounds const& b)
+    {
+        if(!b.Empty())
+            Add(b.lo, b.hi);
+    }
+};
+
+// Bits of the voxels x0 .. x0 + kChunkDim - 1 that lie in the span [a, b].
+inline uint32_t SpanMask (int a, int b, int x0)
+{
+    a = std::max(a - x0, 0);
+    b = std::min(b - x0, kChunkMask);
+    if(a > b)
+        return 0;
+    return (~0u >> (31 - b)) & (~0u << a);
+}
+
+// Brushes describe a set of voxels one row at a time. Each has inclusive bounds lo, hi and
+// RowMask(y, z, x0), the bits of the voxels x0 .. x0 + kChunkDim - 1 of row (y, z) that are
+// inside the brush. x0 is always the start of a chunk row.
+
+struct BoxBrush
+{
+    glm::ivec3 lo, hi;
+
+    uint32_t RowMask (int y, int z, int x0) const
+    {
+        return SpanMask(lo.x, hi.x, x0);
+    }
+};
+
+// Voxels whose centers are within radius of center.
+struct SphereBrush
+{
+    glm::vec3 center;
+    float radius;
+    glm::ivec3 lo, hi;
+
+    SphereBrush (glm::vec3 const& center_, float radius_)
+        : center{center_}, radius{radius_},
+          lo{glm::ivec3(glm::floor(center_ - radius_))}, hi{glm::ivec3(glm::floor(center_ + radius_))}
+    {}
+
+    uint32_t RowMask (int y, int z, int x0) const
+    {
+        float dy = y + 0.5f - center.y, dz = z + 0.5f - center.z;
+        float w2 = radius * radius - dy * dy - dz * dz;
+        if(w2 < 0)
+            return 0;
+        float w = std::sqrt(w2);
+        return SpanMask(std::ceil(center.x - w - 0.5f), std::floor(center.x + w - 0.5f), x0);
+    }
+};
+
+// Vertical cylinder: voxels whose centers are within radius of the axis through (center.x,
+// center.y) in x and z, for y in [y0, y1].
+struct CylinderBrush
+{
+    glm::vec2 center;
+    float radius;
+    glm::ivec3 lo, hi;
+
+    CylinderBrush (glm::vec2 const& center_, float radius_, int y0, int y1)
+        : center{center_}, radius{radius_},
+          lo{int(std::floor(center_.x - radius_)), y0, int(std::floor(center_.y - radius_))},
+          hi{int(std::floor(center_.x + radius_)), y1, int(std::floor(center_.y + radius_))}
+    {}
+
+    uint32_t RowMask (int y, int z, int x0) const
+    {
+        float dz = z + 0.5f - center.y;
+        float w2 = radius * radius - dz * dz;
+        if(w2 < 0)
+            return 0;
+        float w = std::sqrt(w2);
+        return SpanMask(std::ceil(center.x - w - 0.5f), std::floor(center.x + w - 0.5f), x0);
+    }
+};
+
+// Arbitrary set of voxels, one flag per voxel of the box [lo, hi].
+struct MaskBrush
+{
+    glm::ivec3 lo, hi;
+    std::vector<uint8_t> mask;
+
+    MaskBrush (glm::ivec3 const& lo_, glm::ivec3 const& hi_)
+        : lo{lo_}, hi{hi_}, mask((hi_.x - lo_.x + 1) * (hi_.y - lo_.y + 1) * (hi_.z - lo_.z + 1))
+    {}
+
+    // Brush covering exactly the given voxels.
+    static MaskBrush FromVoxels (std::vector<glm::ivec3> const& voxs)
+    {
+        if(voxs.empty())
+            return MaskBrush(glm::ivec3(0), glm::ivec3(-1));
+
+        glm::ivec3 lo = voxs[0], hi = voxs[0];
+        for(auto const& p: voxs)
+        {
+            lo = glm::min(lo, p);
+            hi = glm::max(hi, p);
+        }
+        MaskBrush brush(lo, hi);
+        for(auto const& p: voxs)
+            brush.mask[brush.Idx(p)] = 1;
+        return brush;
+    }
+
+    int Idx (glm::ivec3 const& p) const
+    {
+        return (p.x - lo.x) + (hi.x - lo.x + 1) * ((p.y - lo.y) + (hi.y - lo.y + 1) * (p.z - lo.z));
+    }
+
+    uint32_t RowMask (int y, int z, int x0) const
+    {
+        uint32_t m = 0;
+        int a = std::max(lo.x, x0), b = std::min(hi.x, x0 + kChunkMask);
+        if(a > b)
+            return 0;
+        uint8_t const* row = &mask[Idx({a, y, z})];
+        for(int x = a; x <= b; ++x)
+            if(*row++)
+                m |= 1u << (x - x0);
+        return m;
+    }
+};
+
+// Fill the voxels of the brush with v and return the bounds of the voxels that changed.
+// Rows are written a whole chunk row at a time, and chunks are filled in parallel. Chunks that
+// changed, and their neighbours where a change touches the border, are marked dirty.
+template<typename Brush>
+EditBounds Fill (Voxels& grid, Brush const& brush, Block v)
+{
+    // Chunks are created up front since the map cannot be modified from several threads.
+    std::vector<glm::ivec3> keys;
+    std::vector<Chunk*> chunks;
+    glm::ivec3 key_lo = Voxels::ChunkOf(brush.lo), key_hi = Voxels::ChunkOf(brush.hi);
+    for(int cz = key_lo.z; cz <= key_hi.z; ++cz)
+        for(int cy = key_lo.y; cy <= key_hi.y; ++cy)
+            for(int cx = key_lo.x; cx <= key_hi.x; ++cx)
+            {
+                glm::ivec3 key(cx, cy, cz);
+                Chunk* c = grid.FindChunk(key);
+                if(!c)
+                {
+                    // Writing air into unallocated space is a no-op.
+                    if(v == eAir)
+                        continue;
+                    c = &grid.GetOrCreateChunk(key);
+                }
+                keys.push_back(key);
+                chunks.push_back(c);
+            }
+
+    std::vector<EditBounds> chunk_bounds(keys.size());
+    #pragma omp parallel for schedule(dynamic) if(keys.size() > 1)
+    for(int i = 0; i < (int)keys.size(); ++i)
+    {
+        Chunk& chunk = *chunks[i];
+        glm::ivec3 origin = keys[i] * kChunkDim;
+        glm::ivec3 l_lo = glm::max(brush.lo - origin, glm::ivec3(0));
+        glm::ivec3 l_hi = glm::min(brush.hi - origin, glm::ivec3(kChunkMask));
+        EditBounds& bounds = chunk_bounds[i];
+        for(int z = l_lo.z; z <= l_hi.z; ++z)
+            for(int y = l_lo.y; y <= l_hi.y; ++y)
+            {
+                uint32_t mask = brush.RowMask(origin.y + y, origin.z + z, origin.x);
+                uint32_t changed = chunk.SetRow(Chunk::RowIdx(y, z), mask, v);
+                if(changed)
+                    bounds.Add({CountTrailingZeros(changed), y, z}, {31 - CountLeadingZeros(changed), y, z});
+            }
+        if(v == eAir && !bounds.Empty())
+            chunk.RefreshBricks(bounds.lo, bounds.hi);
+    }
+
+    EditBounds bounds;
+    for(int i = 0; i < (int)keys.size(); ++i)
+    {
+        EditBounds const& b = chunk_bounds[i];
+        if(!b.Empty())
+        {
+            glm::ivec3 origin = keys[i] * kChunkDim;
+            bounds.Add(origin + b.lo, origin + b.hi);
+            // Marking the corners marks the neighbour across every border face the change touches.
+            grid.MarkDirty(origin + b.lo);
+            grid.MarkDirty(origin + b.hi);
+        }
+        if(chunks[i]->solid_count == 0)
+            grid.chunks.erase(keys[i]);
+    }
+    return bounds;
+}
+
+// A stored block template, e.g. a tree or a building, indexed by x + dim.x * (y + dim.y * z).
+struct Schematic
+{
+    glm::ivec3 dim;
+    std::vector<Block> blocks;
+
+    Schematic (glm::ivec3 const& dim_ = glm::ivec3(0))
+        : dim{dim_}, blocks(dim_.x * dim_.y * dim_.z, eAir)
+    {}
+
+    // Copy the box [lo, hi] (inclusive) out of the world.
+    static Schematic Copy (Voxels const& grid, glm::ivec3 const& lo, glm::ivec3 const& hi)
+    {
+        Schematic s(hi - lo + 1);
+        for(int z = 0; z < s.dim.z; ++z)
+            for(int y = 0; y < s.dim.y; ++y)
+                for(int x = 0; x < s.dim.x; ++x)
+                    s.At(x, y, z) = grid.Get(lo + glm::ivec3(x, y, z));
+        return s;
+    }
+
+    Block& At (int x, int y, int z)
+    {
+        return blocks[x + dim.x * (y + dim.y * z)];
+    }
+
+    Block At (int x, int y, int z) const
+    {
+        return blocks[x + dim.x * (y + dim.y * z)];
+    }
+};
+
+// The voxels of a schematic placed at origin that hold block type b.
+struct SchematicBrush
+{
+    Schematic const& schematic;
+    glm::ivec3 origin;
+    Block b;
+    glm::ivec3 lo, hi;
+
+    SchematicBrush (Schematic const& schematic_, glm::ivec3 const& origin_, Block b_)
+        : schematic(schematic_), origin{origin_}, b{b_}, lo{origin_}, hi{origin_ + schematic_.dim - 1}
+    {}
+
+    uint32_t RowMask (int y, int z, int x0) const
+    {
+        uint32_t m = 0;
+        int a = std::max(lo.x, x0), e = std::min(hi.x, x0 + kChunkMask);
+        if(a > e)
+            return 0;
+        Block const* row = &schematic.blocks[(a - origin.x) + schematic.dim.x * ((y - origin.y) + schematic.dim.y * (z - origin.z))];
+        for(int x = a; x <= e; ++x)
+            if(*row++ == b)
+                m |= 1u << (x - x0);
+        return m;
+    }
+};
+
+// Stamp a schematic with its minimum corner at origin. Air in the schematic leaves the world
+// untouched. If remap is given, block type t of the schematic is written as remap[t], e.g. to
+// place the same house in stone or in wood. Returns the bounds of the voxels that changed.
+EditBounds Stamp (Voxels& grid, Schematic const& schematic, glm::ivec3 const& origin, Block const* remap = nullptr)
+{
+    bool present[eCount] = {};
+    for(Block b: schematic.blocks)
+        present[b] = true;
+
+    // One fill per block type; a schematic rarely has more than a handful.
+    EditBounds bounds;
+    for(int t = 0; t < eCount; ++t)
+        if(present[t] && t != eAir)
+            bounds.Add(Fill(grid, SchematicBrush(schematic, origin, Block(t)), remap ? remap[t] : Block(t)));
+    return bounds;
+}
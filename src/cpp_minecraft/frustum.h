@@ -0,0 +1,96 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <cstdint>
+
+// Box tests are done four at a time with SSE, which every x86-64 CPU has.
+#if defined(__SSE2__) || defined(_M_X64)
+#define FRUSTUM_SSE 1
+#include <emmintrin.h>
+#endif
+
+// The view frustum of a projection * view matrix, as planes whose inside is where
+// a x + b y + c z + d >= 0 (Gribb and Hartmann, "Fast extraction of viewing frustum planes from
+// the world-view-projection matrix"). The planes are not normalized: only the sign of the
+// distance is used. Stored as one array per coefficient so four boxes are tested against a
+// plane at once.
+//
+// The far plane is left to the GPU's clipping. It is row 3 minus row 2 of the matrix, which
+// cancels to a few ulps when the near plane is as close as the camera's, so in float it would
+// cull boxes that are still in view.
+struct Frustum
+{
+    static constexpr int kNumPlanes = 5; // Left, right, bottom, top, near.
+
+    float a[kNumPlanes], b[kNumPlanes], c[kNumPlanes], d[kNumPlanes];
+
+    explicit Frustum(glm::mat4 const& view_proj)
+    {
+        // Clip space inside is -w <= x, y, z <= w: the planes are row 3 plus or minus rows 0-2.
+        for(int i = 0; i < kNumPlanes; ++i)
+        {
+            int row = i / 2;
+            float sign = (i & 1) ? -1.0f : 1.0f;
+            a[i] = view_proj[0][3] + sign * view_proj[0][row];
+            b[i] = view_proj[1][3] + sign * view_proj[1][row];
+            c[i] = view_proj[2][3] + sign * view_proj[2][row];
+            d[i] = view_proj[3][3] + sign * view_proj[3][row];
+        }
+    }
+
+    // Whether the box with the given center and half extent is at least partly inside. The box
+    // is outside if its corner furthest along a plane's normal is behind the plane. Boxes near a
+    // frustum corner may pass without being inside, which only costs a draw.
+    bool Intersects(glm::vec3 const& center, glm::vec3 const& half) const
+    {
+        for(int i = 0; i < kNumPlanes; ++i)
+        {
+            float r = std::abs(a[i]) * half.x + std::abs(b[i]) * half.y + std::abs(c[i]) * half.z;
+            if(a[i] * center.x + b[i] * center.y + c[i] * center.z + d[i] + r < 0)
+                return false;
+        }
+        return true;
+    }
+
+    // Test n boxes of the same half extent, with centers (x[i], y[i], z[i]). visible[i] is set to
+    // 1 if box i intersects the frustum and 0 otherwise. Returns the number visible.
+    int Cull(float const* x, float const* y, float const* z, glm::vec3 const& half, uint8_t* visible, int n) const
+    {
+        // With a shared extent, the reach of the box along each plane normal is a constant.
+        float reach[kNumPlanes];
+        for(int i = 0; i < kNumPlanes; ++i)
+            reach[i] = d[i] + std::abs(a[i]) * half.x + std::abs(b[i]) * half.y + std::abs(c[i]) * half.z;
+
+        int num_visible = 0, j = 0;
+#ifdef FRUSTUM_SSE
+        for(; j + 4 <= n; j += 4)
+        {
+            __m128 cx = _mm_loadu_ps(x + j), cy = _mm_loadu_ps(y + j), cz = _mm_loadu_ps(z + j);
+            __m128 outside = _mm_setzero_ps();
+            for(int i = 0; i < kNumPlanes; ++i)
+            {
+                __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[i]), cx), _mm_mul_ps(_mm_set1_ps(b[i]), cy)),
+                                         _mm_add_ps(_mm_mul_ps(_mm_set1_ps(c[i]), cz), _mm_set1_ps(reach[i])));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, _mm_setzero_ps()));
+            }
+            int mask = _mm_movemask_ps(outside);
+            for(int k = 0; k < 4; ++k)
+            {
+                visible[j + k] = !(mask >> k & 1);
+                num_visible += visible[j + k];
+            }
+        }
+#endif
+        for(; j < n; ++j)
+        {
+            bool inside = true;
+            for(int i = 0; i < kNumPlanes && inside; ++i)
+                inside = a[i] * x[j] + b[i] * y[j] + c[i] * z[j] + reach[i] >= 0;
+            visible[j] = inside;
+            num_visible += inside;
+        }
+        return num_visible;
+    }
+};
@@ -9,8 +9,17 @@
 #include <lodepng.h>
 
 #include "voxels.h"
+#include "block_updates.h"
+#include "edits.h"
+#include "ray_queries.h"
+#include "world_store.h"
+#include "chunk_streamer.h"
+#include "lighting.h"
+#include "frustum.h"
+#include "visibility.h"
+#include "lod.h"
 #include "player.h"
-#include "perlin.h"
+#include "terrain.h"
 #include "pet.h"
 
 void CreatePetMesh(int v, 
@@ -62,25 +71,87 @@ void CreatePetMesh(int v,
     }
 }
 
+struct ChunkMesh
+{
+    VoxelMesh mesh;
+    std::vector<VoxelVertex> points;
+    uint16_t connectivity = kAllFacesConnected; // Which of the chunk's faces see each other.
+    bool in_view = false;                         // Whether it intersected the last frustum.
+};
+
 class Graphics : public OglwrapExample {
     private:
         int Ngrid;
         float scale_;
         float off_;
-        Voxels voxels_read;
-        Voxels voxels_write;
+        Voxels voxels;
+        // Writes of a block update tick, applied to voxels right after it.
+        VoxelChanges voxel_changes;
+        // Water and lava that may still move.
+        BlockUpdates block_updates_;
+        float t_next_block_tick_ = 0;
+        static constexpr int kMaxBlockTicksPerFrame = 4;
+
+        // Region files of the world, saved in the background every kAutosavePeriod seconds.
+        WorldStore store_;
+        float t_next_autosave_ = 0;
+        static constexpr float kAutosavePeriod = 10;
+
+        // Loads, generates and meshes the chunks around the player on worker threads.
+        Terrain terrain_;
+        ChunkStreamer streamer_;
+        std::vector<glm::ivec3> loaded_chunks_, unloaded_chunks_;
+        std::vector<ChunkStreamer::MeshResult> finished_meshes_;
+
+        // Sun and block light of the resident chunks, baked into the chunk meshes.
+        Lighting lighting_;
 
         // A shader program
         gl::Program prog_;
 
+        // Shader program for chunk meshes, which use packed VoxelVertex vertices.
+        gl::Program voxel_prog_;
+        QuadIndexBuffer quad_indices_;
+
         gl::Texture2D tex_;
 
         glm::vec2 camAng = {0, -M_PI_2};
         glm::vec3 camForward = {1, 0, 0};
 
-        Mesh mesh;
-        std::vector<MeshPoint> points_;
-        std::vector<unsigned> indices_;
+        // One mesh per allocated chunk, rebuilt in the background when the chunk is marked dirty.
+        std::unordered_map<glm::ivec3, ChunkMesh, ChunkHash> chunk_meshes_;
+
+        // Majority-vote reductions of the world, meshed like the chunks. Past lod_distance_
+        // chunk sizes of a level, its chunks are drawn in place of the finer ones (see
+        // LodDrawn). lod_meshes_[l - 1] holds the meshes of level l. Toggled with L.
+        LodGrids lod_;
+        std::unordered_map<glm::ivec3, ChunkMesh, ChunkHash> lod_meshes_[kNumLodLevels];
+        bool lod_enabled_ = true;
+        float lod_distance_ = 1.5f;
+
+        // Chunk meshes are culled each frame: those outside the view frustum, by the centers of
+        // their boxes in world units, then with cave culling (toggled with C) those that cannot
+        // be seen through the air from the camera's chunk. The counts of the last frame are
+        // printed every kCullStatsPeriod.
+        bool cave_culling_ = true;
+        std::vector<glm::ivec3> reachable_chunks_;
+        std::vector<ChunkMesh*> cull_meshes_;
+        std::vector<glm::ivec3> cull_keys_;
+        std::vector<float> cull_x_, cull_y_, cull_z_;
+        std::vector<uint8_t> cull_visible_;
+        int chunks_visible_ = 0;
+        int chunks_culled_ = 0;
+        int chunks_hidden_ = 0;
+        int chunks_replaced_ = 0;
+        int lod_chunks_drawn_ = 0;
+        float t_next_cull_stats_ = 0;
+        static constexpr float kCullStatsPeriod = 5;
+
+        // Bytes uploaded to mesh buffers each frame, summed and maxed over a stats period.
+        size_t upload_bytes_ = 0;
+        size_t upload_writes_ = 0;
+        size_t max_frame_upload_bytes_ = 0;
+        int upload_frames_ = 0;
 
         Mesh screenMesh;
         std::vector<MeshPoint> crossHairPoints_;
@@ -99,24 +170,27 @@ class Graphics : public OglwrapExample {
         bool player_grounded_ = false;
 
         float t_click_prev_ = 0;
+        // How far the mouse reaches, in voxels.
+        static constexpr float kReach = 64;
 
         Player player_;
-        bool need_voxels_update_ = true;
 
         float sun_ang_ = 0.0;
 
+        // Merge coplanar faces into larger quads when meshing. Toggled with G.
+        bool greedy_meshing_ = true;
+        bool print_mesh_stats_ = true;
+
     public:
         Graphics ()
             : Ngrid{64}, 
             scale_{2 / float(Ngrid)}, off_{1.0f},
-            voxels_read(Ngrid, Ngrid, Ngrid), voxels_write(Ngrid, Ngrid, Ngrid),
-            player_(glm::vec3(0.5,5,0)),
-            pet(glm::vec3(0.5, 5, 0), 0.01)
+            store_("../../world"),
+            terrain_(Ngrid, store_.LoadOrCreateSeed(time(NULL))),
+            streamer_(store_, [this](glm::ivec3 const& key, Chunk& chunk) {terrain_.Generate(key, chunk);}),
+            pet(glm::vec3(0.5, 5, 0), 0.01),
+            player_(glm::vec3(0.5,5,0))
         {
-            std::ofstream perlin_out("../../PERLIN.txt");
-            srand(100*time(NULL));
-            auto grid = Perlin3D().Test(4, 16);
-
             crossHairPoints_.emplace_back(-0.02 , -0.002, 0, -1, 0, 0, 0, 0, 602);
             crossHairPoints_.emplace_back(+0.02 , -0.002, 0, -1, 0, 0, 1, 0, 602);
             crossHairPoints_.emplace_back(+0.02 , +0.002, 0, -1, 0, 0, 1, 1, 602);
@@ -183,6 +257,46 @@ class Graphics : public OglwrapExample {
             vs_source.set_source_file("example_shader.vert");
             gl::Shader vs(gl::kVertexShader, vs_source);
 
+            // Voxel vertices are unpacked here. Positions are chunk-local, so each chunk
+            // is placed with the chunkOffset and voxelScale uniforms.
+            gl::ShaderSource voxel_vs_source;
+            voxel_vs_source.set_source(R"""(
+      #version 330 core
+      layout (location=0) in uvec2 inPacked;
+
+      uniform mat4 mvp;
+      uniform vec3 chunkOffset;
+      uniform float voxelScale;
+
+      out vec3 normal;
+      out vec3 position;
+      out vec2 uv;
+      flat out int tex_id;
+      out float ao;
+      out float sun;
+      out float block;
+
+      const vec3 kFaceNormals[6] = vec3[6](
+        vec3(-1, 0, 0), vec3(1, 0, 0), 
+        vec3(0, -1, 0), vec3(0, 1, 0), 
+        vec3(0, 0, -1), vec3(0, 0, 1));
+
+      void main() {
+        uint a = inPacked.x;
+        uint b = inPacked.y;
+        vec3 local = vec3(a & 63u, (a >> 6) & 63u, (a >> 12) & 63u);
+        normal = kFaceNormals[(a >> 18) & 7u];
+        ao = float((a >> 21) & 3u) / 3.0;
+        sun = float((a >> 23) & 15u) / 15.0;
+        block = float((a >> 27) & 15u) / 15.0;
+        uv = vec2(b & 63u, (b >> 6) & 63u);
+        tex_id = int((b >> 12) & 1023u);
+        position = chunkOffset + local * voxelScale;
+        gl_Position = mvp * vec4(position, 1.0);
+      })""");
+            voxel_vs_source.set_source_file("voxel_shader.vert");
+            gl::Shader voxel_vs(gl::kVertexShader, voxel_vs_source);
+
             gl::ShaderSource fs_source;
             fs_source.set_source(R"""(
       #version 330 core
@@ -204,7 +318,9 @@ class Graphics : public OglwrapExample {
 
         // Retrieve bottom left coordinate of sprite from sprite sheet.
         vec2 sprite_coords = vec2(tex_id % sprite_dim, tex_id / sprite_dim + 1);
-        sprite_coords = (sprite_coords + vec2(uv.x, -uv.y)) / float(sprite_dim);
+        // Greedy-meshed quads have UVs spanning several voxels, so wrap to repeat the sprite.
+        vec2 tile_uv = fract(uv);
+        sprite_coords = (sprite_coords + vec2(tile_uv.x, -tile_uv.y)) / float(sprite_dim);
         vec4 tex_col = texture(tex, sprite_coords);
 		vec3 ambient = 0.8 * vec3(1.0);
         fragColor = tex_col * vec4(ambient + d1 * c1, 1.0);
@@ -212,6 +328,43 @@ class Graphics : public OglwrapExample {
             fs_source.set_source_file("example_shader.frag");
             gl::Shader fs(gl::kFragmentShader, fs_source);
 
+            // Chunk meshes are lit by the light levels baked into their vertices: sunlight scaled
+            // by the time of day, or block light if brighter, darkened by ambient occlusion.
+            gl::ShaderSource voxel_fs_source;
+            voxel_fs_source.set_source(R"""(
+      #version 330 core
+      in vec3 normal;
+      in vec3 position;
+      in vec2 uv;
+      flat in int tex_id;
+      in float ao;
+      in float sun;
+      in float block;
+
+      uniform sampler2D tex;
+      uniform int sprite_dim;
+      uniform float sunLight;
+
+      out vec4 fragColor;
+
+      // Sides facing the sun's path are a little brighter than the others.
+      const float kFaceShade[3] = float[3](0.8, 1.0, 0.9);
+
+      void main() {
+        vec2 sprite_coords = vec2(tex_id % sprite_dim, tex_id / sprite_dim + 1);
+        vec2 tile_uv = fract(uv);
+        sprite_coords = (sprite_coords + vec2(tile_uv.x, -tile_uv.y)) / float(sprite_dim);
+        vec4 tex_col = texture(tex, sprite_coords);
+
+        float light = max(sun * sunLight, block);
+        light = 0.08 + 0.92 * light * light;
+        float occlusion = 0.55 + 0.45 * ao;
+        float face = kFaceShade[int(dot(abs(normal), vec3(0, 1, 2)) + 0.5)];
+        fragColor = vec4(tex_col.rgb * light * occlusion * face, tex_col.a);
+      })""");
+            voxel_fs_source.set_source_file("voxel_shader.frag");
+            gl::Shader voxel_fs(gl::kFragmentShader, voxel_fs_source);
+
             // Create a shader program
             prog_.attachShader(vs);
             prog_.attachShader(fs);
@@ -223,6 +376,10 @@ class Graphics : public OglwrapExample {
             (prog_ | "inNormal").bindLocation(1);
             (prog_ | "inUV").bindLocation(2);
 
+            voxel_prog_.attachShader(voxel_vs);
+            voxel_prog_.attachShader(voxel_fs);
+            voxel_prog_.link();
+
             gl::Enable(gl::kDepthTest);
 
             // Set the clear color
@@ -251,6 +408,10 @@ class Graphics : public OglwrapExample {
             }
 
             gl::Uniform<int>(prog_, "sprite_dim") = 32;
+            gl::Use(voxel_prog_);
+            gl::Uniform<int>(voxel_prog_, "sprite_dim") = 32;
+            gl::Uniform<float>(voxel_prog_, "voxelScale") = scale_;
+            gl::Use(prog_);
 
             // Disable cursor.
             glfwSetInputMode(window_, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -258,6 +419,7 @@ class Graphics : public OglwrapExample {
 
             // Set callbacks.
             glfwSetMouseButtonCallback(window_, MouseDiscreteCallback);
+            glfwSetKeyCallback(window_, KeyDiscreteCallback);
 
             // Set user pointer. This is used in the callbacks, which are static.
             glfwSetWindowUserPointer(window_, this);
@@ -266,23 +428,31 @@ class Graphics : public OglwrapExample {
             gl::Enable(gl::kBlend);
             gl::BlendFunc(gl::kSrcAlpha, gl::kOneMinusSrcAlpha);
 
-            #pragma omp parallel for 
-            for(int z = 1; z < voxels_read.Nz - 1; ++z)
-                for(int y = 1; y < voxels_read.Ny - 5; ++y)
-                    for (int x = 1; x < voxels_read.Nx - 1; ++x)
-                    {
-                        if(y < voxels_read.Ny * 0.9)
-                        {
-                            if (grid[x][y][z] <= 0.15)
-                                voxels_read.data[voxels_read.GetIdx(x, y, z)] = eStone;
-                            else
-                                voxels_read.data[voxels_read.GetIdx(x, y, z)] = eAir;
-                        }
-                        else 
-                        {
-                            voxels_read.data[voxels_read.GetIdx(x, y, z)] = eGrass;
-                        }
-                    }
+            // The terrain is Ngrid voxels high and unbounded horizontally. Chunks come in as the
+            // streamer loads them, saved by a previous run or freshly generated.
+            streamer_.y_min = 0;
+            streamer_.y_max = (Ngrid - 1) / kChunkDim;
+            SetViewDistance();
+            lighting_.sky_layer = streamer_.y_max;
+
+            // Load or generate the area around the spawn point up front, in parallel, so the
+            // player does not start out in the void.
+            float t_start = glfwGetTime();
+            int n = streamer_.LoadNow(voxels, (player_.GetPos() + off_) / scale_, &loaded_chunks_);
+            for(auto const& key: loaded_chunks_)
+                block_updates_.WakeChunk(voxels, key);
+            float t_light = glfwGetTime();
+            LightLoadedChunks();
+            std::cout << "World: " << n << " chunks in " << (t_light - t_start) * 1000 << " ms, "
+                << voxels.chunks.size() << " allocated, " << voxels.MemoryBytes() / 1024 << " KiB, lit in "
+                << (glfwGetTime() - t_light) * 1000 << " ms, " << lighting_.MemoryBytes() / 1024 << " KiB" << std::endl;
+        }
+
+        ~Graphics ()
+        {
+            // Write the last edits and wait until they are on disk before anything is torn down.
+            store_.SaveAsync(voxels);
+            store_.Flush();
         }
 
     protected:
@@ -290,69 +460,36 @@ class Graphics : public OglwrapExample {
             float t = glfwGetTime();
             sun_ang_ = glm::radians(t) * 20;
 
-            #pragma omp parallel for 
-            for(int i = 0; i < voxels_read.data.size(); ++i)
-                voxels_write.data[i] = voxels_read.data[i];
-
-            //TODO : MOVE
-            // Update water and other dynamics things.
-            if(fmod(t, 0.3) < 0.01)
+            // Pick up the chunks streamed in since last frame and queue the missing ones.
+            loaded_chunks_.clear();
+            unloaded_chunks_.clear();
+            streamer_.Update(voxels, (player_.GetPos() + off_) / scale_, camForward, &loaded_chunks_, &unloaded_chunks_);
+            for(auto const& key: loaded_chunks_)
+                block_updates_.WakeChunk(voxels, key);
+            for(auto const& key: unloaded_chunks_)
+                lighting_.RemoveChunk(key);
+            LightLoadedChunks();
+
+            // Lazy voxelization. Only chunks touched by edits or streaming are rebuilt.
+            RemeshDirtyChunks();
+
+            // Update water and other dynamic blocks on a fixed timestep. Each tick is committed
+            // right away so the next one sees it; the changed voxels wake their neighbours.
+            int ticks = 0;
+            for(; t >= t_next_block_tick_ && ticks < kMaxBlockTicksPerFrame; ++ticks)
             {
-                #pragma omp parallel for 
-                for(int z = 1; z < voxels_read.Nz - 1; ++z)
-                    for(int y = 1; y < voxels_read.Ny; ++y)
-                        for (int x = 1; x < voxels_read.Nx - 1; ++x)
-                        {
-                            int idx = voxels_read.GetIdx(x,y,z);
-                            auto v = voxels_read.data[idx];
-                            if(v != eWater && v != eLava)
-                                continue;
-
-                            if(voxels_read.data[idx - voxels_read.Nx] == eAir)
-                            {
-                                voxels_write.data[idx - voxels_read.Nx] = v;
-                                need_voxels_update_ = true;
-                            }
-
-                            if(voxels_read.data[idx - voxels_read.Nx * voxels_read.Ny] == eAir && voxels_read.data[idx - voxels_read.Nx * voxels_read.Ny - voxels_read.Nx] != eAir)
-                            {
-                                voxels_write.data[idx - voxels_read.Nx * voxels_read.Ny] = v;
-                                need_voxels_update_ = true;
-                            }
-
-                            if(voxels_read.data[idx + voxels_read.Nx * voxels_read.Ny] == eAir && voxels_read.data[idx + voxels_read.Nx * voxels_read.Ny - voxels_read.Nx] != eAir)
-                            {
-                                voxels_write.data[idx + voxels_read.Nx * voxels_read.Ny] = v;
-                                need_voxels_update_ = true;
-                            }
-
-                            if(voxels_read.data[idx - 1] == eAir && voxels_read.data[idx - 1 - voxels_read.Nx] != eAir)
-                            {
-                                voxels_write.data[idx - 1] = v;
-                                need_voxels_update_ = true;
-                            }
-
-                            if(voxels_read.data[idx + 1] == eAir && voxels_read.data[idx + 1 - voxels_read.Nx] != eAir)
-                            {
-                                voxels_write.data[idx + 1] = v;
-                                need_voxels_update_ = true;
-                            }
-                        }
-            }
-        
-            // Lazy voxelization.
-            if (need_voxels_update_)
-            {
-                Voxelize(voxels_read, indices_, points_);
-                for(auto& pt: points_)
-                    pt.pos = pt.pos * scale_ - off_;
-                need_voxels_update_ = false;
+                block_updates_.Tick(voxels, voxel_changes, [this](glm::ivec3 const& key) {return streamer_.IsResident(key);});
+                voxel_changes.Commit(voxels, [this](glm::ivec3 const& p) {OnVoxelChanged(p);});
+                t_next_block_tick_ += kBlockTickPeriod;
             }
+            // Drop the backlog after a long stall instead of catching up over several frames.
+            if(t >= t_next_block_tick_)
+                t_next_block_tick_ = t + kBlockTickPeriod;
 
             // Player position update.
             glm::vec3 pos = player_.GetPos();
 
-            // Collision detect with voxels_read if in grid. Otherwise, apply gravity/reset to top.
+            // Collision detect with voxels if in grid. Otherwise, apply gravity/reset to top.
             int x_vox = (pos.x + off_) / scale_;
             int y_vox = (pos.y + off_) / scale_;
             int z_vox = (pos.z + off_) / scale_;
@@ -365,9 +502,13 @@ class Graphics : public OglwrapExample {
             {
                 player_.SetPos(glm::vec3(0.5, 10, 0));  
             }
+            else if(!streamer_.IsResident(Voxels::ChunkOf({x_vox, y_vox, z_vox})))
+            {
+                // Hold still until the ground around the player has been streamed in.
+            }
             else 
             {
-                if(voxels_read.data[voxels_read.GetIdx(x_vox, y_vox-2, z_vox)] == eAir)
+                if(voxels.Get(x_vox, y_vox-2, z_vox) == eAir)
                 {
                     player_grounded_ = false;
                     player_.SetForce({0, -grav_const, 0});
@@ -388,8 +529,7 @@ class Graphics : public OglwrapExample {
                 int z_vox = (pos.z + off_) / scale_;
 
                 // On collision, rollback position and velocity.
-                if(voxels_read.data[voxels_read.GetIdx(x_vox, y_vox  , z_vox)] != eAir
-                || voxels_read.data[voxels_read.GetIdx(x_vox, y_vox-1, z_vox)] != eAir)
+                if(voxels.AnySolid({x_vox, y_vox-1, z_vox}, {x_vox, y_vox, z_vox}))
                 {
                     player_.SetPos(prev_pos); // Rollback position.
                     player_.ResetVelocity();
@@ -399,13 +539,29 @@ class Graphics : public OglwrapExample {
             glm::mat4 camera_mat = glm::lookAt(player_.GetPos(), player_.GetPos() + camForward, glm::vec3{0.0f, 1.0f, 0.0f});
             glm::mat4 model_mat = glm::mat4x4(1.0f);
             glm::mat4 proj_mat = glm::perspectiveFov<float>(M_PI/2.0, kScreenWidth, kScreenHeight, 0.0001f, 50);
-            gl::Uniform<glm::mat4>(prog_, "mvp") = proj_mat * camera_mat * model_mat;
-
             auto sun_mat = glm::rotate(glm::mat4x4(1.0f), sun_ang_, glm::vec3(1.0f, 0.0f, 0.0f));
             glm::vec3 lightPos1 = player_.GetPos();
+
+            gl::Use(voxel_prog_);
+            gl::Uniform<glm::mat4>(voxel_prog_, "mvp") = proj_mat * camera_mat * model_mat;
+            gl::Uniform<float>(voxel_prog_, "sunLight") = 0.25f + 0.75f * std::max(0.0f, std::cos(sun_ang_));
+            DrawVisibleChunks(Frustum(proj_mat * camera_mat));
+            if(t >= t_next_cull_stats_)
+            {
+                std::cout << "Culling: " << chunks_visible_ << " chunks drawn, " << chunks_culled_ << " outside the view, "
+                    << chunks_hidden_ << " hidden by terrain, " << chunks_replaced_ << " replaced by "
+                    << lod_chunks_drawn_ << " coarser ones" << std::endl;
+                if(upload_frames_ > 0)
+                    std::cout << "Uploads: " << upload_bytes_ / upload_frames_ / 1024 << " KiB per frame, at most "
+                        << max_frame_upload_bytes_ / 1024 << " KiB, in " << upload_writes_ << " writes over "
+                        << upload_frames_ << " frames" << std::endl;
+                upload_bytes_ = upload_writes_ = max_frame_upload_bytes_ = 0;
+                upload_frames_ = 0;
+                t_next_cull_stats_ = t + kCullStatsPeriod;
+            }
+
+            gl::Use(prog_);
             gl::Uniform<glm::vec3>(prog_, "lightPos1") = lightPos1;
-            mesh.Set(&points_, &indices_);
-            mesh.Render();
 
             // Render pet.
             glm::vec3 pet_diff = player_.GetPos() - pet.pos;
@@ -428,11 +584,225 @@ class Graphics : public OglwrapExample {
 
             gl::Uniform<glm::mat4>(prog_, "mvp") = glm::mat4x4(1.0f);
             screenMesh.Render();
+
+            upload_bytes_ += g_uploadStats.bytes;
+            upload_writes_ += g_uploadStats.uploads;
+            max_frame_upload_bytes_ = std::max(max_frame_upload_bytes_, g_uploadStats.bytes);
+            ++upload_frames_;
+            g_uploadStats = UploadStats();
             HandleKeys();
             HandleMouse();
 
-            // Update voxels.
-            std::swap(voxels_read.data, voxels_write.data);
+            if(t >= t_next_autosave_)
+            {
+                store_.SaveAsync(voxels);
+                t_next_autosave_ = t + kAutosavePeriod;
+            }
+        }
+
+        // Light the chunks that just became resident. Upper chunks go first, so the sunlight
+        // falls through a column in one pass instead of being spread down again by each chunk.
+        void LightLoadedChunks()
+        {
+            std::sort(loaded_chunks_.begin(), loaded_chunks_.end(),
+                      [](glm::ivec3 const& a, glm::ivec3 const& b) {return a.y > b.y;});
+            for(auto const& key: loaded_chunks_)
+                lighting_.AddChunk(voxels, key);
+        }
+
+        void OnVoxelChanged(glm::ivec3 const& p)
+        {
+            block_updates_.WakeAround(p);
+            lighting_.Update(voxels, p, p);
+        }
+
+        // Draw the chunk meshes whose boxes intersect the view frustum and, with cave culling,
+        // that may be seen through the air from the camera, with voxel_prog_ in use.
+        void DrawVisibleChunks(Frustum const& frustum)
+        {
+            cull_meshes_.clear();
+            cull_keys_.clear();
+            cull_x_.clear();
+            cull_y_.clear();
+            cull_z_.clear();
+            float half = kChunkDim * scale_ / 2;
+            for(auto& kv: chunk_meshes_)
+            {
+                glm::vec3 center = glm::vec3(kv.first * kChunkDim) * scale_ - off_ + half;
+                cull_meshes_.push_back(&kv.second);
+                cull_keys_.push_back(kv.first);
+                cull_x_.push_back(center.x);
+                cull_y_.push_back(center.y);
+                cull_z_.push_back(center.z);
+            }
+            int n = cull_meshes_.size();
+            cull_visible_.resize(n);
+            int in_frustum = frustum.Cull(cull_x_.data(), cull_y_.data(), cull_z_.data(), glm::vec3(half), cull_visible_.data(), n);
+            chunks_culled_ = n - in_frustum;
+            chunks_visible_ = 0;
+            chunks_hidden_ = 0;
+            chunks_replaced_ = 0;
+            for(int i = 0; i < n; ++i)
+                cull_meshes_[i]->in_view = cull_visible_[i];
+
+            glm::vec3 camera = (player_.GetPos() + off_) / scale_;
+            auto draw = [&](glm::ivec3 const& key, ChunkMesh& cm)
+            {
+                if(lod_enabled_ && !LodDrawn(camera, key, 0, lod_distance_))
+                {
+                    ++chunks_replaced_;
+                    return;
+                }
+                gl::Uniform<glm::vec3>(voxel_prog_, "chunkOffset") = glm::vec3(key * kChunkDim) * scale_ - off_;
+                cm.mesh.Render();
+                ++chunks_visible_;
+            };
+
+            if(cave_culling_)
+            {
+                // The search covers the chunks the streamer may keep, and the air around them.
+                // It does not enter chunks outside the frustum; those without a mesh are air.
+                glm::ivec3 camera_key = Voxels::ChunkOf(glm::ivec3(glm::floor((player_.GetPos() + off_) / scale_)));
+                int r = streamer_.unload_radius + 1;
+                glm::ivec3 lo(camera_key.x - r, streamer_.y_min - 1, camera_key.z - r);
+                glm::ivec3 hi(camera_key.x + r, streamer_.y_max + 1, camera_key.z + r);
+                auto connectivity = [this](glm::ivec3 const& key)
+                {
+                    auto it = chunk_meshes_.find(key);
+                    return it != chunk_meshes_.end() ? it->second.connectivity : kAllFacesConnected;
+                };
+                auto in_view = [&](glm::ivec3 const& key)
+                {
+                    auto it = chunk_meshes_.find(key);
+                    if(it != chunk_meshes_.end())
+                        return it->second.in_view;
+                    return frustum.Intersects(glm::vec3(key * kChunkDim) * scale_ - off_ + half, glm::vec3(half));
+                };
+                reachable_chunks_.clear();
+                FindVisibleChunks(camera_key, lo, hi, connectivity, reachable_chunks_, in_view);
+
+                for(auto const& key: reachable_chunks_)
+                {
+                    auto it = chunk_meshes_.find(key);
+                    if(it != chunk_meshes_.end() && it->second.in_view)
+                        draw(key, it->second);
+                }
+                chunks_hidden_ = in_frustum - chunks_visible_ - chunks_replaced_;
+            }
+            else
+            {
+                for(int i = 0; i < n; ++i)
+                    if(cull_visible_[i])
+                        draw(cull_keys_[i], *cull_meshes_[i]);
+            }
+
+            // The coarser levels, with voxels 2^level times the size.
+            lod_chunks_drawn_ = 0;
+            if(!lod_enabled_)
+                return;
+            for(int level = 1; level <= kNumLodLevels; ++level)
+            {
+                float size = float(kChunkDim << level) * scale_;
+                gl::Uniform<float>(voxel_prog_, "voxelScale") = scale_ * float(1 << level);
+                for(auto& kv: lod_meshes_[level - 1])
+                {
+                    glm::vec3 origin = glm::vec3(kv.first) * size - off_;
+                    if(!LodDrawn(camera, kv.first, level, lod_distance_) || !frustum.Intersects(origin + size / 2, glm::vec3(size / 2)))
+                        continue;
+                    gl::Uniform<glm::vec3>(voxel_prog_, "chunkOffset") = origin;
+                    kv.second.mesh.Render();
+                    ++lod_chunks_drawn_;
+                }
+            }
+            gl::Uniform<float>(voxel_prog_, "voxelScale") = scale_;
+        }
+
+        // Hand the dirty chunks to the mesher threads and swap in the meshes they finished. A
+        // chunk keeps drawing its old mesh until the new one arrives.
+        void RemeshDirtyChunks()
+        {
+            glm::vec3 center = (player_.GetPos() + off_) / scale_;
+            for(auto const& key: voxels.dirty_chunks)
+            {
+                lod_.MarkChanged(key);
+                if(!voxels.FindChunk(key))
+                {
+                    chunk_meshes_.erase(key);
+                    streamer_.DropMesh(key);
+                    continue;
+                }
+                streamer_.RequestMesh(voxels, key, greedy_meshing_, ChunkStreamer::Priority(key, center, camForward), &lighting_);
+            }
+            voxels.dirty_chunks.clear();
+
+            // Reduce the changed chunks into the coarser levels, and remesh what changed there.
+            lod_.Update(voxels);
+            for(int level = 1; level <= kNumLodLevels; ++level)
+            {
+                Voxels& grid = lod_.Level(level);
+                for(auto const& key: grid.dirty_chunks)
+                {
+                    if(!grid.FindChunk(key))
+                    {
+                        lod_meshes_[level - 1].erase(key);
+                        streamer_.DropMesh(key, level);
+                        continue;
+                    }
+                    float priority = ChunkStreamer::Priority(key, center / float(1 << level), camForward) * float(1 << level);
+                    streamer_.RequestLodMesh(grid, key, level, greedy_meshing_, priority);
+                }
+                grid.dirty_chunks.clear();
+            }
+
+            finished_meshes_.clear();
+            streamer_.TakeMeshes(finished_meshes_);
+            for(auto& r: finished_meshes_)
+            {
+                ChunkMesh& cm = r.level == 0 ? chunk_meshes_[r.key] : lod_meshes_[r.level - 1][r.key];
+                cm.points.swap(r.points);
+                cm.mesh.Set(&cm.points, &quad_indices_, &r.points); // r.points now holds the old vertices.
+                cm.connectivity = r.connectivity;
+            }
+
+            if(print_mesh_stats_ && !chunk_meshes_.empty() && streamer_.PendingMeshes() == 0)
+            {
+                size_t num_points = 0;
+                for(auto const& kv: chunk_meshes_)
+                    num_points += kv.second.points.size();
+                std::cout << (greedy_meshing_ ? "Greedy" : "Per-face") << " meshing: " 
+                    << num_points << " vertices, " << num_points / 2 << " triangles, " 
+                    << num_points * sizeof(VoxelVertex) / 1024 << " KiB in " 
+                    << chunk_meshes_.size() << " chunks" << std::endl;
+                print_mesh_stats_ = false;
+            }
+        }
+
+        // Only called on key events, so holding a key down toggles once.
+        static void KeyDiscreteCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+        {
+            if(action != GLFW_PRESS)
+                return;
+
+            Graphics* g = static_cast<Graphics*>(glfwGetWindowUserPointer(window));
+            if(key == GLFW_KEY_G)
+            {
+                g->greedy_meshing_ = !g->greedy_meshing_;
+                g->voxels.MarkAllDirty();
+                for(int level = 1; level <= kNumLodLevels; ++level)
+                    g->lod_.Level(level).MarkAllDirty();
+                g->print_mesh_stats_ = true;
+            }
+            else if(key == GLFW_KEY_L)
+            {
+                g->lod_enabled_ = !g->lod_enabled_;
+                g->SetViewDistance();
+                std::cout << "Level of detail " << (g->lod_enabled_ ? "on" : "off") << std::endl;
+            }
+            else if(key == GLFW_KEY_C)
+            {
+                g->cave_culling_ = !g->cave_culling_;
+                std::cout << "Cave culling " << (g->cave_culling_ ? "on" : "off") << std::endl;
+            }
         }
 
         // Only called when mouse events (release/press) happen. This is good when you 
@@ -469,30 +839,74 @@ class Graphics : public OglwrapExample {
             if(t - t_click_prev_ < 0.1)
                 return;
 
+            RayQuery pick{(player_.GetPos() + off_) / scale_, camForward, kReach};
             if (glfwGetMouseButton(window_, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
             {
-                glm::ivec3 pos_vox = (player_.GetPos() + off_) / scale_;
-                glm::ivec3 vox_prev;
-                std::vector<glm::ivec3> voxs;
-                auto hit_pos = voxels_read.CastRay(pos_vox, camForward, vox_prev, voxs);
-                SetSquare(voxels_write, hit_pos, 4);
-                need_voxels_update_ = true;
+                // Dig a 4^3 box from the voxel hit, going into the surface it was hit on.
+                RayHit hit = CastRay(voxels, pick);
+                if(hit.block != eAir)
+                {
+                    glm::ivec3 lo = hit.voxel, hi = hit.voxel + 3;
+                    if(hit.face >= 0 && (hit.face & 1))
+                    {
+                        int axis = g_faceNormalAxis[hit.face];
+                        lo[axis] -= 3;
+                        hi[axis] -= 3;
+                    }
+                    if(BoxResident(lo, hi))
+                    {
+                        EditBounds bounds = Fill(voxels, BoxBrush{lo, hi}, eAir);
+                        if(!bounds.Empty())
+                        {
+                            block_updates_.WakeBox(voxels, bounds.lo, bounds.hi);
+                            lighting_.Update(voxels, bounds.lo, bounds.hi);
+                        }
+                    }
+                }
             }
 
             if (glfwGetMouseButton(window_, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS)
             {
-                glm::ivec3 pos_vox = (player_.GetPos() + off_) / scale_;
-                glm::ivec3 vox_prev;
+                // Fill the air along the ray up to the voxel hit, or up to the first chunk that is
+                // not streamed in yet.
                 std::vector<glm::ivec3> voxs;
-                auto hit_pos = voxels_read.CastRay(pos_vox, camForward, vox_prev, voxs);
-                for(auto& v: voxs)
-                    SetSquare(voxels_write, v, 1, ePumpkin);
-                need_voxels_update_ = true;
+                CastRay(voxels, pick, voxs);
+                auto unloaded = std::find_if(voxs.begin(), voxs.end(), [this](glm::ivec3 const& v) {return !BoxResident(v, v);});
+                voxs.erase(unloaded, voxs.end());
+                EditBounds bounds = Fill(voxels, MaskBrush::FromVoxels(voxs), ePumpkin);
+                if(!bounds.Empty())
+                {
+                    block_updates_.WakeBox(voxels, bounds.lo, bounds.hi);
+                    lighting_.Update(voxels, bounds.lo, bounds.hi);
+                }
             }
 
             t_click_prev_ = t;
         }
 
+        // Whether every chunk overlapping the voxel box [lo, hi] is streamed in. The mouse only
+        // edits there: other chunks read as air, and an edit would be lost when they arrive.
+        bool BoxResident (glm::ivec3 const& lo, glm::ivec3 const& hi) const
+        {
+            glm::ivec3 key_lo = Voxels::ChunkOf(lo), key_hi = Voxels::ChunkOf(hi);
+            for(int cz = key_lo.z; cz <= key_hi.z; ++cz)
+                for(int cy = key_lo.y; cy <= key_hi.y; ++cy)
+                    for(int cx = key_lo.x; cx <= key_hi.x; ++cx)
+                        if(!streamer_.IsResident({cx, cy, cz}))
+                            return false;
+            return true;
+        }
+
+        // Distant chunks are drawn at a coarser level of detail, which pays for a view distance
+        // well past what full detail meshes would allow, at the cost of about 7 times the voxel
+        // data kept in memory. With them off, the chunks out of full detail range are evicted
+        // again once the streamer is over its memory budget.
+        void SetViewDistance ()
+        {
+            streamer_.load_radius = lod_enabled_ ? 16 : 6;
+            streamer_.unload_radius = streamer_.load_radius + 2;
+        }
+
         void HandleKeys()
         {
             float moveSpeed = 0.5;
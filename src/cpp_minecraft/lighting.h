@@ -0,0 +1,561 @@
+#pragma once
+
+#include "voxels.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Light levels run from 0 to kMaxLight and drop by one per voxel they spread. Each voxel has two:
+// sunlight, which also falls straight down from the sky without dropping, and block light from
+// emitters. They are packed into a byte, sunlight in the high nibble.
+constexpr int kMaxLight = 15;
+
+inline int SunLight (uint8_t light) {return light >> 4;}
+inline int BlockLight (uint8_t light) {return light & 15;}
+
+// Block light given off by each block type.
+static uint8_t const g_blockLightEmission [eCount] =
+{
+    0, 0, 15, 15, 0, 0, 0, 0, 0, 0,
+};
+
+// Light of the voxels of a chunk, one byte each. Uniformly lit chunks, e.g. open sky or solid
+// rock, store a single level.
+struct LightChunk
+{
+    std::vector<uint8_t> levels; // Indexed like Chunk, empty while every voxel has level uniform.
+    uint8_t uniform = 0;
+
+    uint8_t Get (int idx) const
+    {
+        return levels.empty() ? uniform : levels[idx];
+    }
+
+    void Set (int idx, uint8_t light)
+    {
+        if(levels.empty())
+        {
+            if(light == uniform)
+                return;
+            levels.assign(kChunkVol, uniform);
+        }
+        levels[idx] = light;
+    }
+
+    void Compact ()
+    {
+        if(!levels.empty() && std::all_of(levels.begin(), levels.end(), [this](uint8_t l) {return l == levels[0];}))
+        {
+            uniform = levels[0];
+            levels.clear();
+            levels.shrink_to_fit();
+        }
+    }
+
+    size_t MemoryBytes () const
+    {
+        return sizeof(LightChunk) + levels.capacity();
+    }
+};
+
+// The light around one chunk, copied out of Lighting so that its mesh can be built on another
+// thread: the levels and solid bits of the chunk and of a one voxel shell around it. Used as the
+// shade of the voxelizers, it gives each face corner the average light of the open voxels in
+// front of it and ambient occlusion from the solid ones.
+struct LightNeighbourhood
+{
+    static constexpr int kDim = kChunkDim + 2;
+
+    uint8_t light[kDim * kDim * kDim];
+    // Bit x + 1 of word Row(y, z) is set if voxel (x, y, z) is solid, for x in [-1, kChunkDim].
+    uint64_t solid[kDim * kDim];
+
+    // Local coordinates run from -1 to kChunkDim.
+    static int Idx (int x, int y, int z)
+    {
+        return (x + 1) + kDim * ((y + 1) + kDim * (z + 1));
+    }
+
+    static int Row (int y, int z)
+    {
+        return (y + 1) + kDim * (z + 1);
+    }
+
+    bool Solid (glm::ivec3 const& p) const
+    {
+        return solid[Row(p.y, p.z)] >> (p.x + 1) & 1;
+    }
+
+    void operator() (glm::ivec3 const& p, int face, uint32_t (&corners)[4]) const
+    {
+        int n_ax = g_faceNormalAxis[face], u_ax = g_faceUAxis[face], v_ax = g_faceVAxis[face];
+        glm::ivec3 front = p;
+        front[n_ax] += (face & 1) ? 1 : -1;
+        uint8_t l = light[Idx(front.x, front.y, front.z)];
+        for(int c = 0; c < 4; ++c)
+        {
+            glm::ivec3 side_u = front, side_v = front;
+            side_u[u_ax] += g_faceCorners[face][c][0] ? 1 : -1;
+            side_v[v_ax] += g_faceCorners[face][c][1] ? 1 : -1;
+            glm::ivec3 diagonal = side_u;
+            diagonal[v_ax] = side_v[v_ax];
+            bool s_u = Solid(side_u), s_v = Solid(side_v), s_d = Solid(diagonal);
+
+            // The diagonal is hidden, and does not let light around the corner, when both sides
+            // are solid.
+            int ao = s_u && s_v ? 0 : 3 - s_u - s_v - s_d;
+            int sun = SunLight(l), block = BlockLight(l), n = 1;
+            auto add = [&](bool is_solid, glm::ivec3 const& q)
+            {
+                if(is_solid)
+                    return;
+                uint8_t lq = light[Idx(q.x, q.y, q.z)];
+                sun += SunLight(lq);
+                block += BlockLight(lq);
+                ++n;
+            };
+            add(s_u, side_u);
+            add(s_v, side_v);
+            add(s_d || (s_u && s_v), diagonal);
+            sun = (sun + n / 2) / n;
+            block = (block + n / 2) / n;
+            corners[c] = uint32_t(ao) | uint32_t(sun) << 2 | uint32_t(block) << 6;
+        }
+    }
+};
+
+// Voxel lighting of the loaded chunks. Every chunk that becomes resident is added, which floods
+// in the sunlight from above and the light of its emitters and its neighbours. Block edits are
+// then applied incrementally: light that lost its source is taken away with a removal flood fill,
+// which hands the light it runs into at its border to an addition flood fill that fills the gap
+// back in. The cost is proportional to the voxels whose light changes, not to the world size.
+// Light only spreads through air. Chunk layers above sky_layer are open sky: they are not
+// stored and read as full sunlight. Voxels of chunks that were not added read as dark.
+// Chunks whose mesh shading changed are marked dirty in the grid.
+struct Lighting
+{
+    std::unordered_map<glm::ivec3, LightChunk, ChunkHash> chunks;
+    int sky_layer = 1;
+
+    uint8_t Get (glm::ivec3 const& p) const
+    {
+        glm::ivec3 key = Voxels::ChunkOf(p);
+        auto it = chunks.find(key);
+        return it != chunks.end() ? it->second.Get(Voxels::GetIdx(p)) : Unlit(key);
+    }
+
+    size_t MemoryBytes () const
+    {
+        size_t bytes = sizeof(Lighting);
+        for(auto const& kv: chunks)
+            bytes += sizeof(kv) + kv.second.MemoryBytes();
+        return bytes;
+    }
+
+    // Light chunk key of grid, which just became resident, and spread its light to its lit
+    // neighbours. Every allocated chunk around it is marked dirty, since their meshes read the
+    // light at its border.
+    void AddChunk (Voxels& grid, glm::ivec3 const& key)
+    {
+        if(key.y > sky_layer)
+            return;
+        ResetCache();
+        LightChunk& lc = chunks[key];
+        lc = LightChunk();
+        Chunk const* chunk = grid.FindChunk(key);
+        glm::ivec3 origin = key * kChunkDim;
+        auto solid = [chunk](int x, int y, int z)
+        {
+            return chunk && (chunk->OccupancyRow(Chunk::RowIdx(y, z)) >> x & 1);
+        };
+
+        // Sunlight falls down the columns open to the sky, or to full sunlight in the chunk
+        // above, until the first solid voxel. top[x + kChunkDim * z] is the lowest lit y.
+        auto above = chunks.find(key + glm::ivec3(0, 1, 0));
+        bool open_sky = key.y == sky_layer;
+        std::vector<int> top(kChunkDim * kChunkDim, kChunkDim);
+        if(open_sky || above != chunks.end())
+        {
+            bool all_lit = true;
+            for(int z = 0; z < kChunkDim; ++z)
+                for(int x = 0; x < kChunkDim; ++x)
+                {
+                    int& t = top[x + kChunkDim * z];
+                    if(open_sky || SunLight(above->second.Get(Chunk::GetIdx(x, 0, z))) == kMaxLight)
+                        while(t > 0 && !solid(x, t - 1, z))
+                            --t;
+                    all_lit &= t == 0;
+                }
+            if(all_lit)
+                lc.uniform = kMaxLight << 4;
+            else
+                for(int z = 0; z < kChunkDim; ++z)
+                    for(int x = 0; x < kChunkDim; ++x)
+                        for(int y = top[x + kChunkDim * z]; y < kChunkDim; ++y)
+                            lc.Set(Chunk::GetIdx(x, y, z), kMaxLight << 4);
+
+            // Only the lit voxels next to unlit open ones, or on the border, spread any further.
+            for(int z = 0; z < kChunkDim; ++z)
+                for(int x = 0; x < kChunkDim; ++x)
+                    for(int y = top[x + kChunkDim * z]; y < kChunkDim; ++y)
+                    {
+                        bool spreads = y == 0 || x == 0 || x == kChunkMask || z == 0 || z == kChunkMask;
+                        for(int face = 0; face < 4 && !spreads; ++face)
+                        {
+                            int nx = x + (face == 1) - (face == 0), nz = z + (face == 3) - (face == 2);
+                            spreads = y < top[nx + kChunkDim * nz] && !solid(nx, y, nz);
+                        }
+                        if(spreads)
+                            add_[kSun].push_back(origin + glm::ivec3(x, y, z));
+                    }
+        }
+
+        // Emitters. Chunks whose palette has none are skipped without looking at their voxels.
+        if(chunk && std::any_of(chunk->palette.begin(), chunk->palette.end(), [](Block b) {return g_blockLightEmission[b] > 0;}))
+            for(int idx = 0; idx < kChunkVol; ++idx)
+                if(uint8_t e = g_blockLightEmission[chunk->Get(idx)])
+                {
+                    lc.Set(idx, (lc.Get(idx) & 0xf0) | e);
+                    add_[kBlock].push_back(origin + glm::ivec3(idx & kChunkMask, (idx >> kChunkBits) & kChunkMask, idx >> (2 * kChunkBits)));
+                }
+
+        // Light coming in from the lit neighbours. Full sunlight from above is already in.
+        for(int face = 0; face < 6; ++face)
+        {
+            glm::ivec3 nb_key = key;
+            nb_key[g_faceNormalAxis[face]] += (face & 1) ? 1 : -1;
+            auto nb = chunks.find(nb_key);
+            if(nb == chunks.end())
+                continue;
+            int n_ax = g_faceNormalAxis[face], u_ax = g_faceUAxis[face], v_ax = g_faceVAxis[face];
+            glm::ivec3 lp;
+            lp[n_ax] = (face & 1) ? 0 : kChunkMask;
+            for(int v = 0; v < kChunkDim; ++v)
+                for(int u = 0; u < kChunkDim; ++u)
+                {
+                    lp[u_ax] = u;
+                    lp[v_ax] = v;
+                    uint8_t l = nb->second.Get(Chunk::GetIdx(lp.x, lp.y, lp.z));
+                    glm::ivec3 p = nb_key * kChunkDim + lp;
+                    if(SunLight(l) > 1 && !(face == 3 && SunLight(l) == kMaxLight))
+                        add_[kSun].push_back(p);
+                    if(BlockLight(l) > 1)
+                        add_[kBlock].push_back(p);
+                }
+        }
+
+        Propagate(grid);
+        lc.Compact();
+        for(int dz = -1; dz <= 1; ++dz)
+            for(int dy = -1; dy <= 1; ++dy)
+                for(int dx = -1; dx <= 1; ++dx)
+                    if(grid.FindChunk(key + glm::ivec3(dx, dy, dz)))
+                        grid.dirty_chunks.insert(key + glm::ivec3(dx, dy, dz));
+    }
+
+    // Forget the light of chunk key, e.g. because it was evicted. Light it spread to its
+    // neighbours stays until they are edited or reloaded.
+    void RemoveChunk (glm::ivec3 const& key)
+    {
+        ResetCache();
+        chunks.erase(key);
+    }
+
+    // Bring the light up to date after the voxels in the box [lo, hi] (inclusive) changed, e.g.
+    // the bounds returned by Fill or a single voxel of VoxelChanges::Commit. Voxels whose light
+    // does not match their block and their neighbours seed the removal and addition fills.
+    void Update (Voxels& grid, glm::ivec3 const& lo, glm::ivec3 const& hi)
+    {
+        ResetCache();
+        for(int z = lo.z; z <= hi.z; ++z)
+            for(int y = lo.y; y <= hi.y; ++y)
+                for(int x = lo.x; x <= hi.x; ++x)
+                {
+                    glm::ivec3 p(x, y, z);
+                    if(!Find(grid, p))
+                        continue;
+                    uint8_t l = cur_light_->Get(cur_idx_);
+                    bool solid = CurSolid();
+                    int target[2];
+                    if(solid)
+                    {
+                        target[kSun] = 0;
+                        target[kBlock] = g_blockLightEmission[cur_chunk_->Get(cur_idx_)];
+                    }
+                    else
+                    {
+                        // The most the open neighbours can give.
+                        target[kSun] = IsTopRow(p) ? kMaxLight : 0;
+                        target[kBlock] = 0;
+                        for(int face = 0; face < 6; ++face)
+                        {
+                            glm::ivec3 n = p;
+                            n[g_faceNormalAxis[face]] += (face & 1) ? 1 : -1;
+                            if(!Find(grid, n))
+                                continue;
+                            uint8_t ln = cur_light_->Get(cur_idx_);
+                            int sun = SunLight(ln);
+                            target[kSun] = std::max(target[kSun], face == 3 && sun == kMaxLight ? sun : sun - 1);
+                            target[kBlock] = std::max(target[kBlock], BlockLight(ln) - 1);
+                        }
+                    }
+
+                    for(int ch = 0; ch < 2; ++ch)
+                    {
+                        int level = ch == kSun ? SunLight(l) : BlockLight(l);
+                        if(level == target[ch])
+                            continue;
+                        // A solid voxel only keeps its own emission. An open one is either too
+                        // bright for what is around it, so it and what it lit are taken away and
+                        // filled back in from the border of the removal, or too dark, so it is
+                        // filled in from its neighbours.
+                        if(level > target[ch] || solid)
+                        {
+                            if(level > 0)
+                            {
+                                SetLevel(grid, p, ch, 0);
+                                remove_[ch].push_back({p, level});
+                            }
+                            if(solid && target[ch] > 0)
+                            {
+                                SetLevel(grid, p, ch, target[ch]);
+                                add_[ch].push_back(p);
+                            }
+                        }
+                        else
+                        {
+                            SetLevel(grid, p, ch, target[ch]);
+                            add_[ch].push_back(p);
+                        }
+                    }
+                }
+        Propagate(grid);
+    }
+
+    // Copy the light around chunk key into out.
+    void Gather (Voxels const& grid, glm::ivec3 const& key, LightNeighbourhood& out) const
+    {
+        // The 3x3x3 chunks around key, indexed by offset + 1.
+        LightChunk const* lights[3][3][3];
+        Chunk const* blocks[3][3][3];
+        uint8_t unlit[3][3][3];
+        for(int dz = -1; dz <= 1; ++dz)
+            for(int dy = -1; dy <= 1; ++dy)
+                for(int dx = -1; dx <= 1; ++dx)
+                {
+                    glm::ivec3 k = key + glm::ivec3(dx, dy, dz);
+                    auto it = chunks.find(k);
+                    lights[dz + 1][dy + 1][dx + 1] = it != chunks.end() ? &it->second : nullptr;
+                    blocks[dz + 1][dy + 1][dx + 1] = grid.FindChunk(k);
+                    unlit[dz + 1][dy + 1][dx + 1] = Unlit(k);
+                }
+
+        // Chunk offset and local coordinate of padded coordinate i in [-1, kChunkDim].
+        auto split = [](int i, int& off, int& local)
+        {
+            off = i < 0 ? 0 : i < kChunkDim ? 1 : 2;
+            local = i & kChunkMask;
+        };
+        for(int z = -1; z <= kChunkDim; ++z)
+            for(int y = -1; y <= kChunkDim; ++y)
+            {
+                int oz, lz, oy, ly;
+                split(z, oz, lz);
+                split(y, oy, ly);
+                int row = Chunk::RowIdx(ly, lz);
+                uint64_t s = 0;
+                for(int ox = 0; ox < 3; ++ox)
+                    if(Chunk const* c = blocks[oz][oy][ox])
+                    {
+                        uint64_t r = c->OccupancyRow(row);
+                        // Bit x + 1 for x in [-1, kChunkDim].
+                        s |= ox == 0 ? r >> kChunkMask & 1 : ox == 1 ? r << 1 : (r & 1) << (kChunkDim + 1);
+                    }
+                out.solid[LightNeighbourhood::Row(y, z)] = s;
+
+                uint8_t* dst = &out.light[LightNeighbourhood::Idx(-1, y, z)];
+                for(int ox = 0; ox < 3; ++ox)
+                {
+                    int x0 = ox == 0 ? kChunkMask : 0, n = ox == 1 ? kChunkDim : 1;
+                    LightChunk const* lc = lights[oz][oy][ox];
+                    for(int i = 0; i < n; ++i)
+                        *dst++ = lc ? lc->Get(Chunk::GetIdx(x0 + i, ly, lz)) : unlit[oz][oy][ox];
+                }
+            }
+    }
+
+private:
+    enum Channel {kSun = 0, kBlock = 1};
+
+    struct Removal
+    {
+        glm::ivec3 p;
+        int level;
+    };
+
+    // Flood fill queues by channel, kept to reuse their capacity.
+    std::vector<glm::ivec3> add_[2];
+    std::vector<Removal> remove_[2];
+
+    // The chunk of the last voxel looked up, since the fills mostly stay inside one chunk.
+    glm::ivec3 cur_key_;
+    LightChunk* cur_light_ = nullptr;
+    Chunk const* cur_chunk_ = nullptr;
+    int cur_idx_ = 0;
+    bool cur_valid_ = false;
+
+    // Chunks whose shading changed in the current operation.
+    std::unordered_set<glm::ivec3, ChunkHash> touched_;
+    glm::ivec3 last_touched_;
+    bool any_touched_ = false;
+
+    uint8_t Unlit (glm::ivec3 const& key) const
+    {
+        return key.y > sky_layer ? kMaxLight << 4 : 0;
+    }
+
+    bool IsTopRow (glm::ivec3 const& p) const
+    {
+        return p.y == (sky_layer + 1) * kChunkDim - 1;
+    }
+
+    void ResetCache ()
+    {
+        cur_valid_ = false;
+    }
+
+    // Point the cursor at voxel p. Returns false if p is not in a lit chunk.
+    bool Find (Voxels const& grid, glm::ivec3 const& p)
+    {
+        glm::ivec3 key = Voxels::ChunkOf(p);
+        if(!cur_valid_ || key != cur_key_)
+        {
+            auto it = chunks.find(key);
+            cur_key_ = key;
+            cur_valid_ = true;
+            cur_light_ = it != chunks.end() ? &it->second : nullptr;
+            cur_chunk_ = grid.FindChunk(key);
+        }
+        cur_idx_ = Voxels::GetIdx(p);
+        return cur_light_ != nullptr;
+    }
+
+    bool CurSolid () const
+    {
+        return cur_chunk_ && (cur_chunk_->OccupancyRow(cur_idx_ >> kChunkBits) >> (cur_idx_ & kChunkMask) & 1);
+    }
+
+    static int Level (uint8_t light, int ch)
+    {
+        return ch == kSun ? SunLight(light) : BlockLight(light);
+    }
+
+    // Set the level of channel ch of voxel p, which must be in a lit chunk, and remember which
+    // meshes read it: its chunk, and the chunks across the borders it lies on.
+    void SetLevel (Voxels const& grid, glm::ivec3 const& p, int ch, int level)
+    {
+        Find(grid, p);
+        uint8_t l = cur_light_->Get(cur_idx_);
+        cur_light_->Set(cur_idx_, ch == kSun ? (l & 0x0f) | level << 4 : (l & 0xf0) | level);
+
+        glm::ivec3 key = cur_key_, local = p & kChunkMask;
+        if(!any_touched_ || key != last_touched_)
+        {
+            touched_.insert(key);
+            last_touched_ = key;
+            any_touched_ = true;
+        }
+        glm::ivec3 lo, hi;
+        for(int a = 0; a < 3; ++a)
+        {
+            lo[a] = local[a] == 0 ? -1 : 0;
+            hi[a] = local[a] == kChunkMask ? 1 : 0;
+        }
+        if(lo == hi)
+            return;
+        for(int dz = lo.z; dz <= hi.z; ++dz)
+            for(int dy = lo.y; dy <= hi.y; ++dy)
+                for(int dx = lo.x; dx <= hi.x; ++dx)
+                    touched_.insert(key + glm::ivec3(dx, dy, dz));
+    }
+
+    // Run the removal fills, then the addition fills, of both channels, and mark the chunks
+    // whose light changed dirty.
+    void Propagate (Voxels& grid)
+    {
+        for(int ch = 0; ch < 2; ++ch)
+        {
+            Remove(grid, ch);
+            Add(grid, ch);
+        }
+        for(auto const& key: touched_)
+            grid.dirty_chunks.insert(key);
+        touched_.clear();
+        any_touched_ = false;
+    }
+
+    // Take away the light of the removals and of everything it lit. A neighbour darker than the
+    // removed level was lit by it, as is full sunlight below full sunlight; brighter or equal
+    // neighbours have another source and are queued to spread again.
+    void Remove (Voxels& grid, int ch)
+    {
+        std::vector<Removal>& queue = remove_[ch];
+        for(size_t head = 0; head < queue.size(); ++head)
+        {
+            Removal r = queue[head];
+            for(int face = 0; face < 6; ++face)
+            {
+                glm::ivec3 n = r.p;
+                n[g_faceNormalAxis[face]] += (face & 1) ? 1 : -1;
+                if(!Find(grid, n))
+                    continue;
+                int level = Level(cur_light_->Get(cur_idx_), ch);
+                if(level == 0)
+                    continue;
+                // Emitters keep their light, and the sky keeps lighting the top row.
+                bool fixed = CurSolid() || (ch == kSun && IsTopRow(n));
+                bool lit_by_r = level < r.level || (ch == kSun && face == 2 && r.level == kMaxLight);
+                if(lit_by_r && !fixed)
+                {
+                    SetLevel(grid, n, ch, 0);
+                    queue.push_back({n, level});
+                }
+                else
+                    add_[ch].push_back(n);
+            }
+        }
+        queue.clear();
+    }
+
+    // Spread the light of the queued voxels to their open neighbours, one level less per voxel,
+    // except that full sunlight keeps falling down undimmed.
+    void Add (Voxels& grid, int ch)
+    {
+        std::vector<glm::ivec3>& queue = add_[ch];
+        for(size_t head = 0; head < queue.size(); ++head)
+        {
+            glm::ivec3 p = queue[head];
+            if(!Find(grid, p))
+                continue;
+            int level = Level(cur_light_->Get(cur_idx_), ch);
+            if(level <= 1)
+                continue;
+            for(int face = 0; face < 6; ++face)
+            {
+                glm::ivec3 n = p;
+                n[g_faceNormalAxis[face]] += (face & 1) ? 1 : -1;
+                if(!Find(grid, n) || CurSolid())
+                    continue;
+                int spread = ch == kSun && face == 2 && level == kMaxLight ? level : level - 1;
+                if(Level(cur_light_->Get(cur_idx_), ch) < spread)
+                {
+                    SetLevel(grid, n, ch, spread);
+                    queue.push_back(n);
+                }
+            }
+        }
+        queue.clear();
+    }
+};
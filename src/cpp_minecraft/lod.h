@@ -0,0 +1,180 @@
+#pragma once
+
+#include "voxels.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+// Levels of detail for distant terrain. Level l has one voxel for every 2^l x 2^l x 2^l fine
+// voxels, chosen by majority vote, and is stored as a Voxels grid of its own with chunks of the
+// usual size, so it is meshed by Voxelize like the full detail chunks. A chunk of level l covers
+// the 2^l x 2^l x 2^l fine chunks from key * 2^l: far away, one mesh of about the same number of
+// faces stands in for 8, 64 or 512 full detail ones.
+constexpr int kNumLodLevels = 3;
+
+// Parent of chunk key one level up, and which of its octants key is.
+inline glm::ivec3 LodParent (glm::ivec3 const& key)
+{
+    return {key.x >> 1, key.y >> 1, key.z >> 1};
+}
+
+inline glm::ivec3 LodOctant (glm::ivec3 const& key)
+{
+    return {key.x & 1, key.y & 1, key.z & 1};
+}
+
+// Reduce fine, or air if it is null, into the octant of coarse given by LodOctant, one voxel
+// per 2x2x2 fine voxels. A coarse voxel is solid if at least half of its fine voxels are, with
+// the most common of their blocks; ties go to the upper ones, so grass stays on top. Returns
+// whether any voxel of coarse changed.
+bool ReduceChunk (Chunk const* fine, glm::ivec3 const& octant, Chunk& coarse)
+{
+    constexpr int kHalf = kChunkDim / 2;
+    glm::ivec3 base = octant * kHalf;
+    bool changed = false;
+    for(int cz = 0; cz < kHalf; ++cz)
+        for(int cy = 0; cy < kHalf; ++cy)
+        {
+            // Solid count of each pair of x from the four fine rows, two bits per pair.
+            uint32_t rows[4] = {};
+            if(fine)
+                for(int i = 0; i < 4; ++i)
+                    rows[i] = fine->OccupancyRow(Chunk::RowIdx(2 * cy + (i & 1), 2 * cz + (i >> 1)));
+            uint32_t pairs[4];
+            for(int i = 0; i < 4; ++i)
+                pairs[i] = (rows[i] & 0x55555555u) + (rows[i] >> 1 & 0x55555555u);
+
+            for(int cx = 0; cx < kHalf; ++cx)
+            {
+                int solid = 0;
+                for(int i = 0; i < 4; ++i)
+                    solid += pairs[i] >> (2 * cx) & 3;
+
+                Block b = eAir;
+                if(solid >= 4)
+                {
+                    // Fine voxels from the top layer down.
+                    Block v[8];
+                    int n = 0;
+                    for(int dy = 1; dy >= 0; --dy)
+                        for(int dz = 0; dz < 2; ++dz)
+                            for(int dx = 0; dx < 2; ++dx)
+                                v[n++] = fine->Get(2 * cx + dx, 2 * cy + dy, 2 * cz + dz);
+                    int best = 0;
+                    for(int i = 0; i < 8; ++i)
+                    {
+                        if(v[i] == eAir)
+                            continue;
+                        int count = std::count(v, v + 8, v[i]);
+                        if(count > best)
+                        {
+                            best = count;
+                            b = v[i];
+                        }
+                    }
+                }
+
+                int idx = Chunk::GetIdx(base.x + cx, base.y + cy, base.z + cz);
+                if(coarse.Get(idx) != b)
+                {
+                    coarse.Set(idx, b);
+                    changed = true;
+                }
+            }
+        }
+    return changed;
+}
+
+// The coarser levels of a grid, kept up to date a chunk at a time. Fine chunks that changed or
+// were removed are passed to MarkChanged, and Update then reduces them into level 1, the level 1
+// chunks that changed into level 2, and so on. Coarse chunks whose voxels changed are marked
+// dirty in their level's grid.
+struct LodGrids
+{
+    Voxels levels[kNumLodLevels]; // levels[l - 1] is level l.
+
+    Voxels& Level (int level) {return levels[level - 1];}
+    Voxels const& Level (int level) const {return levels[level - 1];}
+
+    void MarkChanged (glm::ivec3 const& key)
+    {
+        changed_.insert(key);
+    }
+
+    void Update (Voxels const& grid)
+    {
+        Voxels const* finer = &grid;
+        std::unordered_set<glm::ivec3, ChunkHash> next;
+        for(int level = 1; level <= kNumLodLevels; ++level)
+        {
+            Voxels& coarse = Level(level);
+            for(auto const& key: changed_)
+            {
+                glm::ivec3 parent = LodParent(key);
+                Chunk const* fine = finer->FindChunk(key);
+                Chunk* c = coarse.FindChunk(parent);
+                if(!c)
+                {
+                    if(!fine)
+                        continue;
+                    c = &coarse.GetOrCreateChunk(parent);
+                }
+                if(ReduceChunk(fine, LodOctant(key), *c))
+                    next.insert(parent);
+                else if(c->solid_count == 0)
+                    coarse.chunks.erase(parent); // Created for a fine chunk that reduced to air.
+            }
+            for(auto const& key: next)
+            {
+                auto it = coarse.chunks.find(key);
+                if(it->second.solid_count == 0)
+                    coarse.chunks.erase(it);
+                else
+                    it->second.Compact();
+                coarse.dirty_chunks.insert(key);
+            }
+            changed_.swap(next);
+            next.clear();
+            finer = &coarse;
+        }
+        changed_.clear();
+    }
+
+    size_t MemoryBytes () const
+    {
+        size_t bytes = 0;
+        for(auto const& grid: levels)
+            bytes += grid.MemoryBytes();
+        return bytes;
+    }
+
+private:
+    std::unordered_set<glm::ivec3, ChunkHash> changed_; // Fine chunks to reduce again.
+};
+
+// Whether chunk key of level is close enough to camera, in fine voxels, to be replaced by its
+// 8 children of the level below: closer to its box than lod_distance times its size.
+inline bool LodSplit (glm::vec3 const& camera, glm::ivec3 const& key, int level, float lod_distance)
+{
+    float size = float(kChunkDim << level);
+    glm::vec3 lo = glm::vec3(key) * size;
+    glm::vec3 d = glm::max(glm::max(lo - camera, camera - (lo + size)), glm::vec3(0.0f));
+    return glm::length(d) < lod_distance * size;
+}
+
+// Whether chunk key of level is drawn: every coarser chunk containing it is split, and it is not,
+// unless it is at full detail (level 0). Exactly one level is drawn anywhere, so the selected
+// chunks tile space without overlaps, and levels grow coarser with the distance from camera.
+inline bool LodDrawn (glm::vec3 const& camera, glm::ivec3 const& key, int level, float lod_distance)
+{
+    if(level > 0 && LodSplit(camera, key, level, lod_distance))
+        return false;
+    glm::ivec3 ancestor = key;
+    for(int l = level + 1; l <= kNumLodLevels; ++l)
+    {
+        ancestor = LodParent(ancestor);
+        if(!LodSplit(camera, ancestor, l, lod_distance))
+            return false;
+    }
+    return true;
+}
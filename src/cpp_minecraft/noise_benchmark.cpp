@@ -0,0 +1,228 @@
+// Compares the noise generators for terrain: speed in samples per second and spectral quality,
+// on the grid sizes Perlin3D::Test is used with. Then times a layered terrain density built with
+// noise_expr.h against its noise evaluations on their own.
+
+#include "noise_expr.h"
+#include "perlin.h"
+#include "simplex.h"
+
+#include <chrono>
+#include <complex>
+#include <cstdio>
+#include <functional>
+
+static double NowSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Samples of a noise on the M^3 grid of Test, with z fastest.
+using Sampler = std::function<void (int M, float step, std::vector<float>& out)>;
+
+// Power spectrum of the z = const slices of a M^3 grid, as fractions in octave bands, and how
+// much power lies on the axes compared to the rest of the ring at the same frequency, averaged
+// over the rings. Isotropic noise gives 1; lattice artifacts show up as axis-aligned power.
+static void Spectrum(std::vector<float> const& vals, int M, std::vector<double>& bands, double& axis_ratio)
+{
+    const double pi = std::acos(-1.0);
+    std::vector<std::complex<double>> twiddle(M);
+    for(int k = 0; k < M; ++k)
+        twiddle[k] = std::polar(1.0, -2 * pi * k / M);
+
+    std::vector<double> power(M * M, 0.0);
+    int num_slices = std::min(M, 8);
+    std::vector<std::complex<double>> rows(M * M), spec(M * M);
+    for(int s = 0; s < num_slices; ++s)
+    {
+        int z = s * M / num_slices;
+        double mean = 0;
+        for(int y = 0; y < M; ++y)
+            for(int x = 0; x < M; ++x)
+                mean += vals[(x * M + y) * M + z];
+        mean /= M * M;
+
+        // Separable DFT: along x, then along y.
+        for(int y = 0; y < M; ++y)
+            for(int kx = 0; kx < M; ++kx)
+            {
+                std::complex<double> sum = 0;
+                for(int x = 0; x < M; ++x)
+                    sum += (vals[(x * M + y) * M + z] - mean) * twiddle[(kx * x) % M];
+                rows[y * M + kx] = sum;
+            }
+        for(int kx = 0; kx < M; ++kx)
+            for(int ky = 0; ky < M; ++ky)
+            {
+                std::complex<double> sum = 0;
+                for(int y = 0; y < M; ++y)
+                    sum += rows[y * M + kx] * twiddle[(ky * y) % M];
+                spec[ky * M + kx] = sum;
+            }
+        for(int i = 0; i < M * M; ++i)
+            power[i] += std::norm(spec[i]);
+    }
+
+    // Bands of one octave each, in cycles per slice.
+    bands.assign(6, 0.0);
+    double total = 0;
+    int num_rings = M / 2;
+    std::vector<double> on_axis(num_rings, 0.0), ring(num_rings, 0.0);
+    std::vector<int> n_on(num_rings, 0), n_ring(num_rings, 0);
+    for(int ky = 0; ky < M; ++ky)
+        for(int kx = 0; kx < M; ++kx)
+        {
+            int fx = kx <= M / 2 ? kx : kx - M, fy = ky <= M / 2 ? ky : ky - M;
+            double p = power[ky * M + kx];
+            double r = std::sqrt(double(fx * fx + fy * fy));
+            if(r == 0)
+                continue;
+            total += p;
+            int band = std::min(5, std::max(0, int(std::floor(std::log2(r)))));
+            bands[band] += p;
+            int r_int = int(std::lround(r));
+            if(r_int >= num_rings)
+                continue;
+            ring[r_int] += p;
+            ++n_ring[r_int];
+            if(fx == 0 || fy == 0)
+            {
+                on_axis[r_int] += p;
+                ++n_on[r_int];
+            }
+        }
+    for(double& b: bands)
+        b /= total;
+
+    double sum = 0;
+    int n = 0;
+    for(int r = 2; r < num_rings; ++r)
+        if(ring[r] > 0)
+        {
+            sum += (on_axis[r] / n_on[r]) / (ring[r] / n_ring[r]);
+            ++n;
+        }
+    axis_ratio = sum / n;
+}
+
+// Seconds to evaluate f at every voxel center of a M^3 grid; the sum is kept so the work counts.
+template<class F>
+static double Time(F const& f, int M, double& sum)
+{
+    double t0 = NowSeconds();
+    sum = 0;
+    for(int x = 0; x < M; ++x)
+        for(int y = 0; y < M; ++y)
+            for(int z = 0; z < M; ++z)
+                sum += f(glm::vec3(x, y, z) + 0.5f);
+    return NowSeconds() - t0;
+}
+
+static void RunLayered(int M)
+{
+    // Rolling hills, and warped mountains, selected by a low frequency biome noise.
+    expr::Fbm hills_fbm(Fbm3D(2, 4), 1 / 64.0f), mountains_fbm(Fbm3D(3, 5), 1 / 96.0f);
+    expr::Noise wx(Perlin3D(4), 1 / 32.0f), wy(Perlin3D(5), 1 / 32.0f), wz(Perlin3D(6), 1 / 32.0f);
+    expr::Noise biome(Perlin3D(7), 1 / 256.0f);
+    expr::HeightGradient height(0, float(M));
+    auto hills = height - 0.4f - 0.3f * hills_fbm;
+    auto mountains = expr::Warp(height - 0.7f - 0.6f * mountains_fbm, wx, wy, wz, 12);
+    auto density = expr::Clamp(expr::Select(biome, hills, mountains, 0, 0.1f), -1, 1);
+
+    double sum, leaf_sum;
+    double t = Time(density, M, sum);
+    double t_leaves = Time(biome, M, leaf_sum) + Time(hills_fbm, M, leaf_sum) + Time(mountains_fbm, M, leaf_sum)
+                      + Time(wx, M, leaf_sum) + Time(wy, M, leaf_sum) + Time(wz, M, leaf_sum);
+    int solid = 0;
+    for(int x = 0; x < M; x += 4)
+        for(int y = 0; y < M; y += 4)
+            for(int z = 0; z < M; z += 4)
+                solid += density(glm::vec3(x, y, z) + 0.5f) <= 0;
+    std::printf("Layered density  %4d^3 %8.1f M/s  %.2f s, each noise on its own %.2f s  solid %.2f  (checksum %g)\n",
+                M, double(M) * M * M / t / 1e6, t, t_leaves, solid / std::pow(M / 4.0, 3), sum);
+}
+
+static void Run(char const* name, Sampler const& sample, int N, int K)
+{
+    int M = N * K;
+    std::vector<float> vals(size_t(M) * M * M);
+    double t0 = NowSeconds();
+    sample(M, 1.0f / K, vals);
+    double t = NowSeconds() - t0;
+
+    double mean = 0, var = 0;
+    float lo = vals[0], hi = vals[0];
+    for(float v: vals)
+    {
+        mean += v;
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+    }
+    mean /= vals.size();
+    for(float v: vals)
+        var += (v - mean) * (v - mean);
+    var /= vals.size();
+
+    std::vector<double> bands;
+    double axis_ratio;
+    Spectrum(vals, M, bands, axis_ratio);
+
+    std::printf("%-16s %4d^3 %8.1f M/s  range [%6.3f, %6.3f]  std %.3f  axis/ring power %.2f  bands",
+                name, M, vals.size() / t / 1e6, lo, hi, std::sqrt(var), axis_ratio);
+    for(double b: bands)
+        std::printf(" %5.3f", b);
+    std::printf("\n");
+}
+
+int main()
+{
+    Perlin3D perlin(1);
+    Simplex3D simplex(1);
+    Simplex4D simplex4(1);
+
+    Sampler perlin_scalar = [&](int M, float step, std::vector<float>& out)
+    {
+        for(int x = 0; x < M; ++x)
+            for(int y = 0; y < M; ++y)
+                for(int z = 0; z < M; ++z)
+                    out[(x * M + y) * M + z] = perlin.GetPerlin(glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f) * step);
+    };
+    Sampler perlin_batch = [&](int M, float step, std::vector<float>& out)
+    {
+        std::vector<float> px(M), py(M), pz(M);
+        for(int z = 0; z < M; ++z)
+            pz[z] = (z + 0.5f) * step;
+        for(int x = 0; x < M; ++x)
+            for(int y = 0; y < M; ++y)
+            {
+                std::fill(px.begin(), px.end(), (x + 0.5f) * step);
+                std::fill(py.begin(), py.end(), (y + 0.5f) * step);
+                perlin.GetPerlin(px.data(), py.data(), pz.data(), &out[(x * M + y) * M], M);
+            }
+    };
+    Sampler simplex_scalar = [&](int M, float step, std::vector<float>& out)
+    {
+        for(int x = 0; x < M; ++x)
+            for(int y = 0; y < M; ++y)
+                for(int z = 0; z < M; ++z)
+                    out[(x * M + y) * M + z] = simplex.GetSimplex(glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f) * step);
+    };
+    // A 3D slice of the 4D noise at a fixed w, as one frame of noise that changes over time.
+    Sampler simplex4_slice = [&](int M, float step, std::vector<float>& out)
+    {
+        const float w = 0.37f;
+        for(int x = 0; x < M; ++x)
+            for(int y = 0; y < M; ++y)
+                for(int z = 0; z < M; ++z)
+                    out[(x * M + y) * M + z] = simplex4.GetSimplex(glm::vec4((x + 0.5f) * step, (y + 0.5f) * step, (z + 0.5f) * step, w));
+    };
+
+    std::printf("Power bands are fractions of the spectrum in octaves of 1, 2, 4, ... cycles per slice.\n");
+    for(int N: {4, 8})
+    {
+        Run("Perlin3D", perlin_scalar, N, 16);
+        Run("Perlin3D batch", perlin_batch, N, 16);
+        Run("Simplex3D", simplex_scalar, N, 16);
+        Run("Simplex4D slice", simplex4_slice, N, 16);
+    }
+    RunLayered(128);
+}
@@ -0,0 +1,350 @@
+#pragma once
+
+#include "perlin.h"
+
+#include <algorithm>
+
+// Generators composed from noise with ordinary operators, e.g. a density that is negative below
+// rolling hills:
+//
+//     auto density = expr::HeightGradient(0, 64) - 0.5f - 0.4f * expr::Fbm(Fbm3D(seed, 4), 1 / 32.0f);
+//
+// Every node is its own type, so a whole expression is a single type whose operator() the
+// compiler inlines into one per-sample function: no virtual calls and no buffers between nodes.
+// Nodes also bound themselves over a box by interval arithmetic, which lets Terrain skip uniform
+// regions, and have a batch Eval that hands noise leaves to their batch kernels where it can.
+namespace expr
+{
+
+// Base of all nodes. Derived provides
+//     float operator()(glm::vec3 const& p) const                        the value at p
+//     glm::vec2 Bounds(glm::vec3 const& lo, glm::vec3 const& hi) const  conservative [min, max]
+//                                                                       over the box [lo, hi]
+// and may hide Eval with a faster batch version.
+template<class Derived>
+struct Node
+{
+    Derived const& Self() const {return static_cast<Derived const&>(*this);}
+
+    // Values at the n points (x[i], y[i], z[i]), written to out[i].
+    void Eval(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        for(int i = 0; i < n; ++i)
+            out[i] = Self()(glm::vec3(x[i], y[i], z[i]));
+    }
+};
+
+// Runs batch with the points scaled by frequency, a block at a time.
+template<class Batch>
+void EvalScaled(Batch const& batch, float frequency, float const* x, float const* y, float const* z, float* out, int n)
+{
+    constexpr int kBlock = 64;
+    float px[kBlock], py[kBlock], pz[kBlock];
+    for(int i0 = 0; i0 < n; i0 += kBlock)
+    {
+        int m = std::min(kBlock, n - i0);
+        for(int i = 0; i < m; ++i)
+        {
+            px[i] = x[i0 + i] * frequency;
+            py[i] = y[i0 + i] * frequency;
+            pz[i] = z[i0 + i] * frequency;
+        }
+        batch(px, py, pz, out + i0, m);
+    }
+}
+
+struct Constant : Node<Constant>
+{
+    float value;
+
+    Constant(float value_)
+        : value{value_}
+    {}
+
+    float operator()(glm::vec3 const&) const {return value;}
+
+    glm::vec2 Bounds(glm::vec3 const&, glm::vec3 const&) const {return glm::vec2(value);}
+
+    void Eval(float const*, float const*, float const*, float* out, int n) const
+    {
+        std::fill(out, out + n, value);
+    }
+};
+
+// Perlin3D at p * frequency.
+struct Noise : Node<Noise>
+{
+    Perlin3D noise;
+    float frequency;
+
+    explicit Noise(Perlin3D const& noise_, float frequency_ = 1)
+        : noise{noise_}, frequency{frequency_}
+    {}
+
+    float operator()(glm::vec3 const& p) const {return noise.GetPerlin(p * frequency);}
+
+    glm::vec2 Bounds(glm::vec3 const& lo, glm::vec3 const& hi) const
+    {
+        glm::vec2 r;
+        noise.Bounds(lo * frequency, hi * frequency, r.x, r.y);
+        return r;
+    }
+
+    void Eval(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        EvalScaled([this](float const* px, float const* py, float const* pz, float* o, int m)
+                   {noise.GetPerlin(px, py, pz, o, m);}, frequency, x, y, z, out, n);
+    }
+};
+
+// Fbm3D at p * frequency.
+struct Fbm : Node<Fbm>
+{
+    Fbm3D fbm;
+    float frequency;
+
+    explicit Fbm(Fbm3D const& fbm_, float frequency_ = 1)
+        : fbm{fbm_}, frequency{frequency_}
+    {}
+
+    float operator()(glm::vec3 const& p) const {return fbm.Get(p * frequency);}
+
+    glm::vec2 Bounds(glm::vec3 const& lo, glm::vec3 const& hi) const
+    {
+        glm::vec2 r;
+        fbm.Bounds(lo * frequency, hi * frequency, r.x, r.y);
+        return r;
+    }
+
+    void Eval(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        EvalScaled([this](float const* px, float const* py, float const* pz, float* o, int m)
+                   {fbm.Get(px, py, pz, o, m);}, frequency, x, y, z, out, n);
+    }
+};
+
+// 0 at height y0, rising linearly to 1 at y1.
+struct HeightGradient : Node<HeightGradient>
+{
+    float y0;
+    float slope;
+
+    HeightGradient(float y0_, float y1_)
+        : y0{y0_}, slope{1 / (y1_ - y0_)}
+    {}
+
+    float operator()(glm::vec3 const& p) const {return (p.y - y0) * slope;}
+
+    glm::vec2 Bounds(glm::vec3 const& lo, glm::vec3 const& hi) const
+    {
+        float a = (lo.y - y0) * slope, b = (hi.y - y0) * slope;
+        return glm::vec2(std::min(a, b), std::max(a, b));
+    }
+};
+
+// The arithmetic of Binary, on values and on ranges.
+struct AddOp
+{
+    static float Apply(float a, float b) {return a + b;}
+    static glm::vec2 Apply(glm::vec2 const& a, glm::vec2 const& b) {return a + b;}
+};
+
+struct SubOp
+{
+    static float Apply(float a, float b) {return a - b;}
+    static glm::vec2 Apply(glm::vec2 const& a, glm::vec2 const& b) {return glm::vec2(a.x - b.y, a.y - b.x);}
+};
+
+struct MulOp
+{
+    static float Apply(float a, float b) {return a * b;}
+    static glm::vec2 Apply(glm::vec2 const& a, glm::vec2 const& b)
+    {
+        float p[4] = {a.x * b.x, a.x * b.y, a.y * b.x, a.y * b.y};
+        return glm::vec2(*std::min_element(p, p + 4), *std::max_element(p, p + 4));
+    }
+};
+
+template<class Op, class A, class B>
+struct Binary : Node<Binary<Op, A, B>>
+{
+    A a;
+    B b;
+
+    Binary(A const& a_, B const& b_)
+        : a{a_}, b{b_}
+    {}
+
+    float operator()(glm::vec3 const& p) const {return Op::Apply(a(p), b(p));}
+
+    glm::vec2 Bounds(glm::vec3 const& lo, glm::vec3 const& hi) const
+    {
+        return Op::Apply(a.Bounds(lo, hi), b.Bounds(lo, hi));
+    }
+
+    // With a constant operand the other one is evaluated in batch and combined in place.
+    void Eval(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        EvalWith(a, b, x, y, z, out, n);
+    }
+
+private:
+    template<class T>
+    void EvalWith(T const&, Constant const& c, float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        a.Eval(x, y, z, out, n);
+        for(int i = 0; i < n; ++i)
+            out[i] = Op::Apply(out[i], c.value);
+    }
+
+    template<class T>
+    void EvalWith(Constant const& c, T const&, float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        b.Eval(x, y, z, out, n);
+        for(int i = 0; i < n; ++i)
+            out[i] = Op::Apply(c.value, out[i]);
+    }
+
+    void EvalWith(Constant const& c0, Constant const& c1, float const*, float const*, float const*, float* out, int n) const
+    {
+        std::fill(out, out + n, Op::Apply(c0.value, c1.value));
+    }
+
+    template<class T, class U>
+    void EvalWith(T const&, U const&, float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        Node<Binary>::Eval(x, y, z, out, n);
+    }
+};
+
+template<class A, class B> using Sum = Binary<AddOp, A, B>;
+template<class A, class B> using Difference = Binary<SubOp, A, B>;
+template<class A, class B> using Product = Binary<MulOp, A, B>;
+
+// a + b, a - b and a * b, for nodes and floats in any combination but two floats.
+#define NOISE_EXPR_OPERATOR(op, Op) \
+    template<class A, class B> \
+    Binary<Op, A, B> operator op (Node<A> const& a, Node<B> const& b) {return Binary<Op, A, B>(a.Self(), b.Self());} \
+    template<class A> \
+    Binary<Op, A, Constant> operator op (Node<A> const& a, float b) {return Binary<Op, A, Constant>(a.Self(), b);} \
+    template<class B> \
+    Binary<Op, Constant, B> operator op (float a, Node<B> const& b) {return Binary<Op, Constant, B>(a, b.Self());}
+
+NOISE_EXPR_OPERATOR(+, AddOp)
+NOISE_EXPR_OPERATOR(-, SubOp)
+NOISE_EXPR_OPERATOR(*, MulOp)
+
+#undef NOISE_EXPR_OPERATOR
+
+template<class A>
+struct Clamped : Node<Clamped<A>>
+{
+    A a;
+    float lo;
+    float hi;
+
+    Clamped(A const& a_, float lo_, float hi_)
+        : a{a_}, lo{lo_}, hi{hi_}
+    {}
+
+    float operator()(glm::vec3 const& p) const {return glm::clamp(a(p), lo, hi);}
+
+    glm::vec2 Bounds(glm::vec3 const& box_lo, glm::vec3 const& box_hi) const
+    {
+        return glm::clamp(a.Bounds(box_lo, box_hi), lo, hi);
+    }
+
+    void Eval(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        a.Eval(x, y, z, out, n);
+        for(int i = 0; i < n; ++i)
+            out[i] = glm::clamp(out[i], lo, hi);
+    }
+};
+
+template<class A>
+Clamped<A> Clamp(Node<A> const& a, float lo, float hi)
+{
+    return Clamped<A>(a.Self(), lo, hi);
+}
+
+// Domain warp: src at p moved by amplitude * (wx(p), wy(p), wz(p)).
+template<class S, class W>
+struct Warped : Node<Warped<S, W>>
+{
+    S src;
+    W wx, wy, wz;
+    float amplitude;
+
+    Warped(S const& src_, W const& wx_, W const& wy_, W const& wz_, float amplitude_)
+        : src{src_}, wx{wx_}, wy{wy_}, wz{wz_}, amplitude{amplitude_}
+    {}
+
+    float operator()(glm::vec3 const& p) const
+    {
+        return src(p + amplitude * glm::vec3(wx(p), wy(p), wz(p)));
+    }
+
+    // src over the box grown by the range of the offsets.
+    glm::vec2 Bounds(glm::vec3 const& lo, glm::vec3 const& hi) const
+    {
+        glm::vec2 rx = wx.Bounds(lo, hi), ry = wy.Bounds(lo, hi), rz = wz.Bounds(lo, hi);
+        glm::vec3 d_lo = amplitude * glm::vec3(rx.x, ry.x, rz.x);
+        glm::vec3 d_hi = amplitude * glm::vec3(rx.y, ry.y, rz.y);
+        return src.Bounds(lo + glm::min(d_lo, d_hi), hi + glm::max(d_lo, d_hi));
+    }
+};
+
+template<class S, class W>
+Warped<S, W> Warp(Node<S> const& src, Node<W> const& wx, Node<W> const& wy, Node<W> const& wz, float amplitude)
+{
+    return Warped<S, W>(src.Self(), wx.Self(), wy.Self(), wz.Self(), amplitude);
+}
+
+// Biome select: a where selector is below threshold - falloff, b where it is above threshold +
+// falloff, and a smooth blend in between. Only the branches that are used are evaluated.
+template<class S, class A, class B>
+struct Selected : Node<Selected<S, A, B>>
+{
+    S selector;
+    A a;
+    B b;
+    float threshold;
+    float falloff;
+
+    Selected(S const& selector_, A const& a_, B const& b_, float threshold_, float falloff_)
+        : selector{selector_}, a{a_}, b{b_}, threshold{threshold_}, falloff{falloff_}
+    {}
+
+    float operator()(glm::vec3 const& p) const
+    {
+        float s = selector(p);
+        if(s <= threshold - falloff)
+            return a(p);
+        if(s >= threshold + falloff)
+            return b(p);
+        float w = glm::smoothstep(threshold - falloff, threshold + falloff, s);
+        float va = a(p);
+        return va + (b(p) - va) * w;
+    }
+
+    glm::vec2 Bounds(glm::vec3 const& lo, glm::vec3 const& hi) const
+    {
+        glm::vec2 s = selector.Bounds(lo, hi);
+        if(s.y <= threshold - falloff)
+            return a.Bounds(lo, hi);
+        if(s.x >= threshold + falloff)
+            return b.Bounds(lo, hi);
+        // Blends stay between the two.
+        glm::vec2 ra = a.Bounds(lo, hi), rb = b.Bounds(lo, hi);
+        return glm::vec2(std::min(ra.x, rb.x), std::max(ra.y, rb.y));
+    }
+};
+
+template<class S, class A, class B>
+Selected<S, A, B> Select(Node<S> const& selector, Node<A> const& a, Node<B> const& b, float threshold, float falloff = 0)
+{
+    return Selected<S, A, B>(selector.Self(), a.Self(), b.Self(), threshold, falloff);
+}
+
+} // namespace expr
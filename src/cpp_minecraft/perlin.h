@@ -2,28 +2,67 @@
 
 #include "voxels.h"
 #include <random>
+#include <vector>
 
+// The batch evaluation has an AVX2 kernel, picked at runtime when the CPU supports it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PERLIN_AVX2 1
+#include <immintrin.h>
+#endif
+
+// Finalizer of the integer hashes of grid points used by the noise generators.
+inline uint32_t MixHash(uint32_t h)
+{
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+}
+
+// Integer hash of a grid point. No tables means this works for any number of grid coordinates.
+inline uint32_t HashGridPoint(glm::ivec3 const& i, uint32_t seed)
+{
+    return MixHash(seed ^ uint32_t(i.x) * 73856093u ^ uint32_t(i.y) * 19349663u ^ uint32_t(i.z) * 83492791u);
+}
+
+// The gradients of Ken Perlin's improved noise: the 12 cube edge directions, 4 of them twice so
+// that the low 4 bits of a hash pick one. They are not normalized. Dot products with them are
+// just additions and sign flips.
+inline glm::vec3 const& GridGradient(uint32_t hash)
+{
+    static glm::vec3 const gradients[16] =
+    {
+        { 1,  1,  0}, {-1,  1,  0}, { 1, -1,  0}, {-1, -1,  0},
+        { 1,  0,  1}, {-1,  0,  1}, { 1,  0, -1}, {-1,  0, -1},
+        { 0,  1,  1}, { 0, -1,  1}, { 0,  1, -1}, { 0, -1, -1},
+        { 1,  1,  0}, { 0, -1,  1}, {-1,  1,  0}, { 0, -1, -1},
+    };
+    return gradients[hash & 15];
+}
+
+// Gradient noise on the integer grid. Each instance owns its seed, so any number of generators
+// can run side by side on any threads, and the same seed always gives the same noise.
 class Perlin3D
 {
 private:
-    inline static glm::vec3 RandomGradient(glm::ivec3 const& i)
+    uint32_t seed_;
+
+    // GridGradient is not normalized, which GetPerlin makes up for with this.
+    static constexpr float kGradientScale = 0.70710678f;
+    // Bound on |GetPerlin|: a gradient of length sqrt(2) dotted with an offset of at most sqrt(3),
+    // times kGradientScale.
+    static constexpr float kMaxAbs = 1.7320508f;
+    static constexpr int kMaxBoundsCells = 64;
+
+    inline glm::vec3 RandomGradient(glm::ivec3 const& i) const
     {
-        // Random float. No precomputed gradients mean this works for any number of grid coordinates
-        static float seed1 = rand() % 1000;
-        static float seed2 = rand() % 1000;
-        static float seed3 = rand() % 1000;
-        static float seed4 = rand() % 1000;
-        float r1 = 2920.f * sin(seed1 * (i.x * 21942.f + i.y * 171324.f + 8912.f)) * cos(seed2 * (i.x * 23157.f * i.y * 217832.f + 9758.f));
-        float r2 = 3371.f * sin(seed3 * (i.y * 289821.f + i.z * 92918.f + 9221.f)) * cos(seed4 * (i.y * 19219.f * i.z * 129102.f + 2819.f));
-        return {cos(r2) * cos(r1), cos(r2) * sin(r1), sin(r2)};
+        return GridGradient(HashGridPoint(i, seed_));
     }
 
-    inline static float DotGridGradient(glm::ivec3 const& i, glm::vec3 const& v) 
+    inline static float DotGridGradient(glm::ivec3 const& i, glm::vec3 const& gradient, glm::vec3 const& v) 
     {
-        // Get gradient from integer coordinates
-        glm::vec3 gradient = RandomGradient(i);
-
-        // Compute the dot-product
         return glm::dot(v - glm::vec3(i), gradient);
     }
 
@@ -45,57 +84,256 @@ private:
         return(a1 - a0) * ((w * (w * 6.0 - 15.0) + 10.0) * w * w * w) + a0;
     }
 
-public:
-    Perlin3D() = default;
+    // The gradients of the eight corners of a grid cell, looked up once and reused for every
+    // sample in the cell.
+    struct Cell
+    {
+        glm::ivec3 p000;
+        glm::vec3 gradients[8]; // Corner c is p000 + (c & 1, (c >> 1) & 1, c >> 2).
+    };
 
-    // If smooth is set, we use smoothStep intepolate instead of linear.
-    float GetPerlin(glm::vec3 p, bool smooth = true)
+    void LookUp(glm::ivec3 const& p000, Cell& cell) const
     {
-        auto lerp_fun = smooth ? InterpolateSmooth : InterpolateLin;
+        cell.p000 = p000;
+        for(int c = 0; c < 8; ++c)
+            cell.gradients[c] = RandomGradient(p000 + glm::ivec3(c & 1, (c >> 1) & 1, c >> 2));
+    }
 
-        // Determine min and max grid cells. 
-        // It is assumed that p is within the grid!
-        glm::ivec3 p000 = p;
-        glm::ivec3 p111 = p000 + glm::ivec3(1);
+    float Interpolate(Cell const& cell, glm::vec3 const& p, bool smooth) const
+    {
+        auto lerp_fun = smooth ? InterpolateSmooth : InterpolateLin;
+        glm::vec3 interp{p - glm::vec3(cell.p000)};
+        float n[8];
+        for(int c = 0; c < 8; ++c)
+            n[c] = DotGridGradient(cell.p000 + glm::ivec3(c & 1, (c >> 1) & 1, c >> 2), cell.gradients[c], p);
+
+        // Interpolate X, then Y to get the values for the Z = 0 and Z = 1 faces, then Z between them.
+        float iy0 = lerp_fun(lerp_fun(n[0], n[1], interp.x), lerp_fun(n[2], n[3], interp.x), interp.y);
+        float iy1 = lerp_fun(lerp_fun(n[4], n[5], interp.x), lerp_fun(n[6], n[7], interp.x), interp.y);
+        return lerp_fun(iy0, iy1, interp.z) * kGradientScale;
+    }
 
-        glm::ivec3 p100 = { p111.x, p000.y, p000.z };
-        glm::ivec3 p010 = { p000.x, p111.y, p000.z };
-        glm::ivec3 p001 = { p000.x, p000.y, p111.z };
+public:
+    explicit Perlin3D(uint32_t seed = 0)
+        : seed_{seed}
+    {}
 
-        glm::ivec3 p110 = { p111.x, p111.y, p000.z };
-        glm::ivec3 p101 = { p111.x, p000.y, p111.z };
-        glm::ivec3 p011 = { p000.x, p111.y, p111.z };
+    uint32_t Seed() const {return seed_;}
 
-        glm::vec3 interp{p - glm::vec3(p000)};
+    // If smooth is set, we use smoothStep intepolate instead of linear.
+    float GetPerlin(glm::vec3 p, bool smooth = true) const
+    {
+        // Determine min and max grid cells. Floored so that negative coordinates work too.
+        Cell cell;
+        LookUp(glm::floor(p), cell);
+        return Interpolate(cell, p, smooth);
+    }
 
-        // Z = 0
-        float n0 = DotGridGradient(p000, p);
-        float n1 = DotGridGradient(p100, p);
-        float ix0 = lerp_fun(n0, n1, interp.x);
+    // Smooth noise at p, with its analytic gradient written to gradient. The derivative of the
+    // quintic interpolant is evaluated in the same pass from the same corner values, which costs
+    // far less than the six extra samples of central differences.
+    float GetPerlin(glm::vec3 const& p, glm::vec3& gradient) const
+    {
+        Cell cell;
+        LookUp(glm::floor(p), cell);
+        glm::vec3 u = p - glm::vec3(cell.p000);
+        glm::vec3 s = u * u * u * (u * (u * 6.0f - 15.0f) + 10.0f);
+        glm::vec3 ds = 30.0f * u * u * (u * (u - 2.0f) + 1.0f);
+
+        float n[8];
+        for(int c = 0; c < 8; ++c)
+            n[c] = DotGridGradient(cell.p000 + glm::ivec3(c & 1, (c >> 1) & 1, c >> 2), cell.gradients[c], p);
+        glm::vec3 const* g = cell.gradients;
+
+        // The blend written out as a polynomial in s, both for the corner values and for the
+        // corner gradients, which are the derivatives of the corner values.
+        float k1 = n[1] - n[0], k2 = n[2] - n[0], k3 = n[4] - n[0];
+        float k4 = n[0] - n[1] - n[2] + n[3];
+        float k5 = n[0] - n[2] - n[4] + n[6];
+        float k6 = n[0] - n[1] - n[4] + n[5];
+        float k7 = -n[0] + n[1] + n[2] - n[3] + n[4] - n[5] - n[6] + n[7];
+        glm::vec3 blend = g[0] + s.x * (g[1] - g[0]) + s.y * (g[2] - g[0]) + s.z * (g[4] - g[0])
+            + s.x * s.y * (g[0] - g[1] - g[2] + g[3])
+            + s.y * s.z * (g[0] - g[2] - g[4] + g[6])
+            + s.z * s.x * (g[0] - g[1] - g[4] + g[5])
+            + s.x * s.y * s.z * (-g[0] + g[1] + g[2] - g[3] + g[4] - g[5] - g[6] + g[7]);
+
+        gradient = (blend + ds * glm::vec3(k1 + k4 * s.y + k6 * s.z + k7 * s.y * s.z,
+                                           k2 + k5 * s.z + k4 * s.x + k7 * s.z * s.x,
+                                           k3 + k6 * s.x + k5 * s.y + k7 * s.x * s.y)) * kGradientScale;
+        return (n[0] + k1 * s.x + k2 * s.y + k3 * s.z + k4 * s.x * s.y + k5 * s.y * s.z + k6 * s.z * s.x
+                + k7 * s.x * s.y * s.z) * kGradientScale;
+    }
 
-        n0 = DotGridGradient(p010, p);
-        n1 = DotGridGradient(p110, p);
-        float ix1 = lerp_fun(n0, n1, interp.x);
+    // Smooth noise at the n points (x[i], y[i], z[i]), written to out[i]. Eight points at a time
+    // with AVX2 if the CPU has it, otherwise one by one like GetPerlin, reusing the corner
+    // gradients while consecutive points stay in the same cell. The two agree to within float
+    // rounding, about 1e-6.
+    void GetPerlin(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        int i = 0;
+#ifdef PERLIN_AVX2
+        static bool const has_avx2 = __builtin_cpu_supports("avx2");
+        if(has_avx2)
+            i = GetPerlinAvx2(x, y, z, out, n, seed_);
+#endif
+        Cell cell;
+        bool have_cell = false;
+        for(; i < n; ++i)
+        {
+            glm::vec3 p(x[i], y[i], z[i]);
+            glm::ivec3 p000 = glm::floor(p);
+            if(!have_cell || p000 != cell.p000)
+            {
+                LookUp(p000, cell);
+                have_cell = true;
+            }
+            out[i] = Interpolate(cell, p, true);
+        }
+    }
 
-        // Interpolate Y to get value for Z = 0 face.
-        float iy0 = lerp_fun(ix0, ix1, interp.y);
+    // Conservative range [min, max] of the smooth GetPerlin over the box [lo, hi]. The box is cut
+    // at the grid cells it overlaps and the ranges in the cells are merged; boxes over more than
+    // kMaxBoundsCells cells just get the range of the whole noise.
+    void Bounds(glm::vec3 const& lo, glm::vec3 const& hi, float& min, float& max) const
+    {
+        glm::ivec3 c_lo = glm::floor(lo), c_hi = glm::floor(hi);
+        glm::ivec3 cells = c_hi - c_lo + 1;
+        if(cells.x * cells.y * cells.z > kMaxBoundsCells)
+        {
+            min = -kMaxAbs;
+            max = kMaxAbs;
+            return;
+        }
+        min = kMaxAbs;
+        max = -kMaxAbs;
+        for(int z = c_lo.z; z <= c_hi.z; ++z)
+            for(int y = c_lo.y; y <= c_hi.y; ++y)
+                for(int x = c_lo.x; x <= c_hi.x; ++x)
+                {
+                    glm::vec3 c(x, y, z);
+                    float cell_min, cell_max;
+                    CellBounds(glm::max(lo, c), glm::min(hi, c + 1.0f), cell_min, cell_max);
+                    min = std::min(min, cell_min);
+                    max = std::max(max, cell_max);
+                }
+    }
 
-        // Z = 1
-        n0 = DotGridGradient(p001, p);
-        n1 = DotGridGradient(p101, p);
-        ix0 = lerp_fun(n0, n1, interp.x);
+    // Bounds over a box within a single grid cell. Each corner's dot product is linear, so its
+    // range over the box is found at the box corners. The interpolation weights are monotonic and
+    // each lerp is monotonic in its endpoints, so the ranges are carried through the lerps exactly.
+    // The bounds are tight for boxes much smaller than a cell.
+    void CellBounds(glm::vec3 const& lo, glm::vec3 const& hi, float& min, float& max) const
+    {
+        glm::ivec3 p000 = glm::floor(lo);
+        glm::vec3 s_lo, s_hi;
+        for(int a = 0; a < 3; ++a)
+        {
+            s_lo[a] = InterpolateSmooth(0, 1, lo[a] - p000[a]);
+            s_hi[a] = InterpolateSmooth(0, 1, hi[a] - p000[a]);
+        }
+
+        // Ranges of the corner dot products, then of the lerps along x, y and z in turn.
+        glm::vec2 r[8];
+        for(int corner = 0; corner < 8; ++corner)
+        {
+            glm::ivec3 c = p000 + glm::ivec3(corner & 1, (corner >> 1) & 1, corner >> 2);
+            glm::vec3 g = RandomGradient(c);
+            r[corner] = glm::vec2(0);
+            for(int a = 0; a < 3; ++a)
+            {
+                float d_lo = g[a] * (lo[a] - c[a]), d_hi = g[a] * (hi[a] - c[a]);
+                r[corner] += glm::vec2(std::min(d_lo, d_hi), std::max(d_lo, d_hi));
+            }
+        }
+        auto lerp_range = [](glm::vec2 const& a, glm::vec2 const& b, float w_lo, float w_hi)
+        {
+            return glm::vec2(std::min(a.x + (b.x - a.x) * w_lo, a.x + (b.x - a.x) * w_hi),
+                             std::max(a.y + (b.y - a.y) * w_lo, a.y + (b.y - a.y) * w_hi));
+        };
+        for(int a = 0, n = 8; a < 3; ++a, n /= 2)
+            for(int i = 0; i < n / 2; ++i)
+                r[i] = lerp_range(r[2 * i], r[2 * i + 1], s_lo[a], s_hi[a]);
+        min = r[0].x * kGradientScale;
+        max = r[0].y * kGradientScale;
+    }
 
-        n0 = DotGridGradient(p011, p);
-        n1 = DotGridGradient(p111, p);
-        ix1 = lerp_fun(n0, n1, interp.x);
+#ifdef PERLIN_AVX2
+private:
+    // Dot product of the offset (x, y, z) with the gradients picked by the hashes h, without
+    // looking them up: u is x or y and v is y, x or z by hash, each negated by one hash bit.
+    __attribute__((target("avx2")))
+    static __m256 GradientDot(__m256i h, __m256 x, __m256 y, __m256 z)
+    {
+        __m256i low = _mm256_and_si256(h, _mm256_set1_epi32(15));
+        __m256 u_is_x = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), low));
+        __m256 v_is_y = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), low));
+        __m256 v_is_x = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_or_si256(low, _mm256_set1_epi32(2)), _mm256_set1_epi32(14)));
+        __m256 u = _mm256_blendv_ps(y, x, u_is_x);
+        __m256 v = _mm256_blendv_ps(_mm256_blendv_ps(z, x, v_is_x), y, v_is_y);
+        __m256 u_sign = _mm256_castsi256_ps(_mm256_slli_epi32(h, 31));
+        __m256 v_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(h, 1), 31));
+        return _mm256_add_ps(_mm256_xor_ps(u, u_sign), _mm256_xor_ps(v, v_sign));
+    }
 
-        // Interpolate Y to get value for Z = 1 face.
-        float iy1 = lerp_fun(ix0, ix1, interp.y);
+    __attribute__((target("avx2")))
+    static __m256i HashAvx2(__m256i x, __m256i y, __m256i z, __m256i seed)
+    {
+        __m256i h = _mm256_xor_si256(seed, _mm256_mullo_epi32(x, _mm256_set1_epi32(73856093)));
+        h = _mm256_xor_si256(h, _mm256_mullo_epi32(y, _mm256_set1_epi32(19349663)));
+        h = _mm256_xor_si256(h, _mm256_mullo_epi32(z, _mm256_set1_epi32(83492791)));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x2c1b3c6d));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 12));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x297a2d39));
+        return _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+    }
 
-        // Interpolate Z between Z = 0 and Z = 1 face.
-        return lerp_fun(iy0, iy1, interp.z);
+    // Returns the number of points done, a multiple of 8.
+    __attribute__((target("avx2")))
+    static int GetPerlinAvx2(float const* px, float const* py, float const* pz, float* out, int n, uint32_t seed_value)
+    {
+        __m256i seed = _mm256_set1_epi32(seed_value);
+        __m256i one_i = _mm256_set1_epi32(1);
+        __m256 one = _mm256_set1_ps(1);
+        int i = 0;
+        for(; i + 8 <= n; i += 8)
+        {
+            __m256 p[3] = {_mm256_loadu_ps(px + i), _mm256_loadu_ps(py + i), _mm256_loadu_ps(pz + i)};
+            __m256i c0[3], c1[3];
+            __m256 d0[3], d1[3], s[3];
+            for(int a = 0; a < 3; ++a)
+            {
+                __m256 f = _mm256_floor_ps(p[a]);
+                c0[a] = _mm256_cvttps_epi32(f);
+                c1[a] = _mm256_add_epi32(c0[a], one_i);
+                d0[a] = _mm256_sub_ps(p[a], f);
+                d1[a] = _mm256_sub_ps(d0[a], one);
+                // Quintic smoothstep, as in InterpolateSmooth.
+                __m256 w = d0[a];
+                __m256 poly = _mm256_add_ps(_mm256_mul_ps(w, _mm256_sub_ps(_mm256_mul_ps(w, _mm256_set1_ps(6)), _mm256_set1_ps(15))), _mm256_set1_ps(10));
+                s[a] = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(w, w), w), poly);
+            }
+
+            // Corner dot products, lerped along x, then y, then z.
+            __m256 r[8];
+            for(int corner = 0; corner < 8; ++corner)
+            {
+                int bx = corner & 1, by = (corner >> 1) & 1, bz = corner >> 2;
+                __m256i h = HashAvx2(bx ? c1[0] : c0[0], by ? c1[1] : c0[1], bz ? c1[2] : c0[2], seed);
+                r[corner] = GradientDot(h, bx ? d1[0] : d0[0], by ? d1[1] : d0[1], bz ? d1[2] : d0[2]);
+            }
+            for(int a = 0, m = 8; a < 3; ++a, m /= 2)
+                for(int j = 0; j < m / 2; ++j)
+                    r[j] = _mm256_add_ps(r[2 * j], _mm256_mul_ps(_mm256_sub_ps(r[2 * j + 1], r[2 * j]), s[a]));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(r[0], _mm256_set1_ps(kGradientScale)));
+        }
+        return i;
     }
 
+public:
+#endif
+
     // Test on an NxNxN grid with K samples per k gridcell.
     std::vector<std::vector<std::vector<float>>> Test(int N, int K)
     {
@@ -113,6 +351,113 @@ public:
     }
 };
 
+// Fractal Brownian motion: octaves of Perlin3D, each at lacunarity times the frequency and gain
+// times the amplitude of the one before, summed and scaled back to the range of one octave.
+// Every octave has its own seed derived from the base seed, so they are uncorrelated and cannot
+// share gradients; within an octave the batch evaluation shares them between the samples of a
+// cell, which for the coarse octaves is nearly all of them.
+class Fbm3D
+{
+private:
+    std::vector<Perlin3D> octaves_;
+    float lacunarity_;
+    float gain_;
+    float norm_;
+
+public:
+    Fbm3D(uint32_t seed, int octaves, float lacunarity = 2, float gain = 0.5f)
+        : lacunarity_{lacunarity}, gain_{gain}, norm_{0}
+    {
+        float amplitude = 1;
+        for(int k = 0; k < octaves; ++k)
+        {
+            octaves_.emplace_back(seed + uint32_t(k) * 0x9e3779b9u);
+            norm_ += amplitude;
+            amplitude *= gain;
+        }
+        norm_ = 1 / norm_;
+    }
+
+    float Get(glm::vec3 p) const
+    {
+        float sum = 0, amplitude = 1;
+        for(auto const& octave: octaves_)
+        {
+            sum += amplitude * octave.GetPerlin(p);
+            p *= lacunarity_;
+            amplitude *= gain_;
+        }
+        return sum * norm_;
+    }
+
+    // Get, with the analytic gradient of the sum written to gradient.
+    float Get(glm::vec3 p, glm::vec3& gradient) const
+    {
+        float sum = 0, amplitude = 1, frequency = 1;
+        gradient = glm::vec3(0);
+        for(auto const& octave: octaves_)
+        {
+            glm::vec3 g;
+            sum += amplitude * octave.GetPerlin(p, g);
+            gradient += (amplitude * frequency) * g;
+            p *= lacunarity_;
+            frequency *= lacunarity_;
+            amplitude *= gain_;
+        }
+        gradient *= norm_;
+        return sum * norm_;
+    }
+
+    // Batch version of Get. Each octave evaluates a block of points with one batch call.
+    void Get(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        constexpr int kBlock = 64;
+        float px[kBlock], py[kBlock], pz[kBlock], noise[kBlock];
+        for(int i0 = 0; i0 < n; i0 += kBlock)
+        {
+            int m = std::min(kBlock, n - i0);
+            std::copy(x + i0, x + i0 + m, px);
+            std::copy(y + i0, y + i0 + m, py);
+            std::copy(z + i0, z + i0 + m, pz);
+            std::fill(out + i0, out + i0 + m, 0.0f);
+            float amplitude = 1;
+            for(auto const& octave: octaves_)
+            {
+                octave.GetPerlin(px, py, pz, noise, m);
+                for(int i = 0; i < m; ++i)
+                {
+                    out[i0 + i] += amplitude * noise[i];
+                    px[i] *= lacunarity_;
+                    py[i] *= lacunarity_;
+                    pz[i] *= lacunarity_;
+                }
+                amplitude *= gain_;
+            }
+            for(int i = 0; i < m; ++i)
+                out[i0 + i] *= norm_;
+        }
+    }
+
+    // Conservative range [min, max] of Get over the box [lo, hi], the sum of the octaves' ranges.
+    void Bounds(glm::vec3 lo, glm::vec3 hi, float& min, float& max) const
+    {
+        float amplitude = 1;
+        min = max = 0;
+        for(auto const& octave: octaves_)
+        {
+            float o_min, o_max;
+            octave.Bounds(lo, hi, o_min, o_max);
+            min += amplitude * o_min;
+            max += amplitude * o_max;
+            lo *= lacunarity_;
+            hi *= lacunarity_;
+            amplitude *= gain_;
+        }
+        min *= norm_;
+        max *= norm_;
+    }
+};
+
 // This is just for testing out my perlin noise implementation. It is not used in the game.
 class Perlin2D
 {
@@ -159,9 +504,8 @@ public:
     {
         auto lerp_fun = smooth ? InterpolateSmooth : InterpolateLin;
 
-        // Determine min and max grid cells. 
-        // It is assumed that p is within the grid!
-        glm::ivec2 p00 = p;
+        // Determine min and max grid cells. Floored so that negative coordinates work too.
+        glm::ivec2 p00 = glm::floor(p);
         glm::ivec2 p11 = p00 + glm::ivec2(1);
         glm::ivec2 p01 = { p00.x, p11.y };
         glm::ivec2 p10 = { p11.x, p00.y };
@@ -177,6 +521,29 @@ public:
         return lerp_fun(ix0, ix1, p.y - p00.y);
     }
 
+    // Smooth noise at p, with its analytic gradient written to gradient, as for Perlin3D.
+    float GetPerlin(glm::vec2 const& p, glm::vec2& gradient)
+    {
+        glm::ivec2 p00 = glm::floor(p);
+        glm::vec2 u = p - glm::vec2(p00);
+        glm::vec2 s = u * u * u * (u * (u * 6.0f - 15.0f) + 10.0f);
+        glm::vec2 ds = 30.0f * u * u * (u * (u - 2.0f) + 1.0f);
+
+        glm::vec2 g[4];
+        float n[4];
+        for(int c = 0; c < 4; ++c)
+        {
+            glm::ivec2 corner = p00 + glm::ivec2(c & 1, c >> 1);
+            g[c] = RandomGradient(corner);
+            n[c] = glm::dot(p - glm::vec2(corner), g[c]);
+        }
+
+        float k1 = n[1] - n[0], k2 = n[2] - n[0], k3 = n[0] - n[1] - n[2] + n[3];
+        glm::vec2 blend = g[0] + s.x * (g[1] - g[0]) + s.y * (g[2] - g[0]) + s.x * s.y * (g[0] - g[1] - g[2] + g[3]);
+        gradient = blend + ds * glm::vec2(k1 + k3 * s.y, k2 + k3 * s.x);
+        return n[0] + k1 * s.x + k2 * s.y + k3 * s.x * s.y;
+    }
+
     // Test on an NxN grid with K samples per k gridcell.
     std::vector<std::vector<float>> Test(int N, int K)
     {
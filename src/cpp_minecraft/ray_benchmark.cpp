@@ -0,0 +1,141 @@
+// Times the ray queries of ray_queries.h on a test world of hills and caves, one at a time and
+// batched, and checks their hits against a plain voxel by voxel walk and the voxels collected
+// along rays.
+
+#include "ray_queries.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+static double NowSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The first solid voxel along q, stepping one voxel at a time and reading every one of them.
+static RayHit WalkRay(Voxels const& grid, RayQuery const& q)
+{
+    RayHit hit{glm::ivec3(0), q.max_dist, -1, eAir};
+    glm::vec3 dir = glm::normalize(q.dir);
+    glm::ivec3 p(glm::floor(q.origin)), step;
+    glm::vec3 t_max, t_delta;
+    for(int a = 0; a < 3; ++a)
+    {
+        step[a] = dir[a] < 0 ? -1 : 1;
+        t_delta[a] = dir[a] != 0 ? std::abs(1 / dir[a]) : std::numeric_limits<float>::infinity();
+        t_max[a] = dir[a] != 0 ? (p[a] + (step[a] > 0) - q.origin[a]) / dir[a] : std::numeric_limits<float>::infinity();
+    }
+    float t = 0;
+    int face = -1;
+    while(t <= q.max_dist)
+    {
+        Block b = grid.Get(p.x, p.y, p.z);
+        if(b != eAir)
+            return {p, t, face, b};
+        int a = t_max.x < t_max.y ? (t_max.x < t_max.z ? 0 : 2) : (t_max.y < t_max.z ? 1 : 2);
+        t = t_max[a];
+        p[a] += step[a];
+        t_max[a] += t_delta[a];
+        face = 2 * a + (step[a] < 0);
+    }
+    return hit;
+}
+
+// Hills of grass over stone, hollowed out by spherical caves, kDim x kHeight x kDim voxels.
+static void BuildWorld(Voxels& grid, int dim, int height)
+{
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> across(0, dim), up(0, height / 2), radius(3, 8);
+    std::vector<glm::vec4> caves(dim * dim / 256);
+    for(auto& c: caves)
+        c = glm::vec4(across(rng), up(rng), across(rng), radius(rng));
+
+    for(int x = 0; x < dim; ++x)
+        for(int z = 0; z < dim; ++z)
+        {
+            int top = int(height / 2 + height / 4 * std::sin(x * 0.07f) * std::cos(z * 0.05f));
+            for(int y = 0; y <= top; ++y)
+            {
+                glm::vec3 p(x, y, z);
+                bool in_cave = false;
+                for(auto const& c: caves)
+                    in_cave |= glm::length(p - glm::vec3(c)) < c.w;
+                if(in_cave)
+                    continue;
+                glm::ivec3 v(x, y, z);
+                grid.GetOrCreateChunk(Voxels::ChunkOf(v)).Set(Voxels::GetIdx(v), y == top ? eGrass : eStone);
+            }
+        }
+}
+
+int main()
+{
+    const int kHeight = 64, kChunks = 8;
+    Voxels grid;
+    BuildWorld(grid, kChunks * kChunkDim, kHeight);
+
+    // Rays from above the terrain in random directions, as from a player looking around.
+    const int kNumRays = 1 << 18;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> across(0, kChunks * kChunkDim), unit(-1, 1);
+    std::vector<RayQuery> queries(kNumRays);
+    for(auto& q: queries)
+    {
+        q.origin = glm::vec3(across(rng), kHeight - 0.5f, across(rng));
+        do
+            q.dir = glm::vec3(unit(rng), unit(rng), unit(rng));
+        while(glm::length(q.dir) < 0.1f);
+        q.max_dist = 256;
+    }
+
+    std::vector<RayHit> hits(kNumRays), walked(kNumRays);
+    double t0 = NowSeconds();
+    for(int i = 0; i < kNumRays; ++i)
+        hits[i] = CastRay(grid, queries[i]);
+    double t_single = NowSeconds() - t0;
+
+    t0 = NowSeconds();
+    CastRays(grid, queries.data(), kNumRays, hits.data());
+    double t_batch = NowSeconds() - t0;
+
+    t0 = NowSeconds();
+    for(int i = 0; i < kNumRays; ++i)
+        walked[i] = WalkRay(grid, queries[i]);
+    double t_walk = NowSeconds() - t0;
+
+    int num_hits = 0, mismatches = 0;
+    for(int i = 0; i < kNumRays; ++i)
+    {
+        num_hits += hits[i].block != eAir;
+        // A ray through an edge or corner of voxels may enter any of them, depending on rounding,
+        // so solid hits at the same distance count as the same.
+        bool hit = hits[i].block != eAir, walk_hit = walked[i].block != eAir;
+        bool same = hit == walk_hit;
+        if(same && hit)
+            same = (hits[i].voxel == walked[i].voxel && hits[i].face == walked[i].face && hits[i].block == walked[i].block)
+                   || std::abs(hits[i].dist - walked[i].dist) < 1e-3f;
+        mismatches += !same;
+    }
+    // The voxels collected along a ray must be air, each next to the one before it.
+    int bad_trails = 0;
+    std::vector<glm::ivec3> traversed;
+    for(int i = 0; i < kNumRays; i += 64)
+    {
+        traversed.clear();
+        CastRay(grid, queries[i], traversed);
+        for(size_t j = 0; j < traversed.size(); ++j)
+            if(grid.Get(traversed[j]) != eAir || (j > 0 && glm::length(glm::vec3(traversed[j] - traversed[j - 1])) != 1))
+            {
+                ++bad_trails;
+                break;
+            }
+    }
+
+    std::printf("CastRay   %8.2f M rays/s\n", kNumRays / t_single / 1e6);
+    std::printf("CastRays  %8.2f M rays/s\n", kNumRays / t_batch / 1e6);
+    std::printf("Voxel walk %7.2f M rays/s\n", kNumRays / t_walk / 1e6);
+    std::printf("%d of %d rays hit, %d differ from the voxel walk, %d bad trails of voxels\n",
+                num_hits, kNumRays, mismatches, bad_trails);
+    return mismatches != 0 || bad_trails != 0;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "voxels.h"
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// A ray in voxel units: voxel (x, y, z) spans [x, x+1) x [y, y+1) x [z, z+1).
+struct RayQuery
+{
+    glm::vec3 origin;
+    glm::vec3 dir;      // Need not be normalized.
+    float max_dist;
+};
+
+// Result of a RayQuery. block is eAir if nothing was hit within max_dist. Otherwise voxel is
+// the first non-air voxel along the ray, dist is the distance to where the ray enters it and
+// face is the face it enters through (LEFT, RIGHT, BOTTOM, TOP, BACK, FRONT, as in
+// g_blockFaceSpriteLookup), or -1 if the ray starts inside it.
+struct RayHit
+{
+    glm::ivec3 voxel;
+    float dist;
+    int face;
+    Block block;
+};
+
+// Trace a single ray with a hierarchical 3D DDA (http://www.cse.yorku.ca/~amana/research/grid.pdf).
+// The ray is first clipped to the allocated chunks since everything outside of them is air.
+// It then crosses unallocated chunks and empty bricks in one step each, and only walks voxel
+// by voxel inside solid bricks, where occupancy is read from the per-row bitmasks. The chunk
+// is only looked up again when the ray crosses into another one. Does not allocate.
+RayHit CastRay (Voxels const& grid, RayQuery const& q)
+{
+    RayHit hit{glm::ivec3(0), q.max_dist, -1, eAir};
+    float len = glm::length(q.dir);
+    if(grid.Empty() || len == 0)
+        return hit;
+    glm::vec3 dir = q.dir / len;
+
+    // Clip to the box of allocated chunks, remembering the face the ray enters it through.
+    glm::vec3 lo(grid.chunk_min * kChunkDim);
+    glm::vec3 hi((grid.chunk_max + 1) * kChunkDim);
+    float t0 = 0, t1 = q.max_dist;
+    int face = -1;
+    for(int a = 0; a < 3; ++a)
+    {
+        if(dir[a] == 0)
+        {
+            if(q.origin[a] < lo[a] || q.origin[a] >= hi[a])
+                return hit;
+            continue;
+        }
+        float ta = (lo[a] - q.origin[a]) / dir[a];
+        float tb = (hi[a] - q.origin[a]) / dir[a];
+        if(ta > tb)
+            std::swap(ta, tb);
+        if(ta > t0)
+        {
+            t0 = ta;
+            face = 2 * a + (dir[a] < 0);
+        }
+        t1 = std::min(t1, tb);
+    }
+    if(t0 > t1)
+        return hit;
+
+    glm::ivec3 step;
+    glm::vec3 inv_dir, t_delta;
+    for(int a = 0; a < 3; ++a)
+    {
+        step[a] = dir[a] < 0 ? -1 : 1;
+        inv_dir[a] = dir[a] != 0 ? 1 / dir[a] : std::numeric_limits<float>::infinity();
+        t_delta[a] = std::abs(inv_dir[a]);
+    }
+
+    // t_max[a] is the distance at which the ray crosses the next voxel boundary along axis a.
+    glm::vec3 t_max;
+    auto reset_t_max = [&](glm::ivec3 const& p)
+    {
+        for(int a = 0; a < 3; ++a)
+            t_max[a] = dir[a] != 0 ? (p[a] + (step[a] > 0) - q.origin[a]) * inv_dir[a] : std::numeric_limits<float>::infinity();
+    };
+
+    float t = t0;
+    glm::ivec3 p = glm::clamp(glm::ivec3(glm::floor(q.origin + t0 * dir)), glm::ivec3(lo), glm::ivec3(hi) - 1);
+    reset_t_max(p);
+    glm::ivec3 key = Voxels::ChunkOf(p);
+    Chunk const* chunk = grid.FindChunk(key);
+    while(true)
+    {
+        // Size of the empty cell around p to skip: a whole chunk or a brick.
+        int cell_bits = kChunkBits;
+        if(chunk)
+        {
+            glm::ivec3 l = p & kChunkMask;
+            if(chunk->BrickSolid(l.x >> kBrickBits, l.y >> kBrickBits, l.z >> kBrickBits))
+            {
+                if((chunk->OccupancyRow(Chunk::RowIdx(l.y, l.z)) >> l.x) & 1)
+                {
+                    hit.voxel = p;
+                    hit.dist = t;
+                    hit.face = face;
+                    hit.block = chunk->Get(l.x, l.y, l.z);
+                    return hit;
+                }
+
+                // Air inside a solid brick: plain voxel step.
+                int a = t_max.x < t_max.y ? (t_max.x < t_max.z ? 0 : 2) : (t_max.y < t_max.z ? 1 : 2);
+                t = t_max[a];
+                if(t > t1)
+                    return hit;
+                p[a] += step[a];
+                t_max[a] += t_delta[a];
+                face = 2 * a + (step[a] < 0);
+                if((p[a] & kChunkMask) == (step[a] > 0 ? 0 : kChunkMask))
+                {
+                    key[a] += step[a];
+                    chunk = grid.FindChunk(key);
+                }
+                continue;
+            }
+            cell_bits = kBrickBits;
+        }
+
+        // Leave the empty cell through the nearest of its faces ahead of the ray.
+        glm::ivec3 cell_lo = p & ~((1 << cell_bits) - 1);
+        glm::ivec3 cell_hi = cell_lo + (1 << cell_bits) - 1;
+        int exit_axis = 0;
+        float t_exit = std::numeric_limits<float>::infinity();
+        for(int a = 0; a < 3; ++a)
+        {
+            if(dir[a] == 0)
+                continue;
+            float t_a = ((step[a] > 0 ? cell_hi[a] + 1 : cell_lo[a]) - q.origin[a]) * inv_dir[a];
+            if(t_a < t_exit)
+            {
+                t_exit = t_a;
+                exit_axis = a;
+            }
+        }
+        t = std::max(t, t_exit);
+        if(t > t1)
+            return hit;
+
+        // The other axes cannot have left the cell yet; clamping guards against rounding.
+        p = glm::clamp(glm::ivec3(glm::floor(q.origin + t * dir)), cell_lo, cell_hi);
+        p[exit_axis] = step[exit_axis] > 0 ? cell_hi[exit_axis] + 1 : cell_lo[exit_axis] - 1;
+        face = 2 * exit_axis + (step[exit_axis] < 0);
+        reset_t_max(p);
+
+        glm::ivec3 next_key = Voxels::ChunkOf(p);
+        if(next_key != key)
+        {
+            key = next_key;
+            chunk = grid.FindChunk(key);
+        }
+    }
+}
+
+// Trace n rays, writing hits[i] for queries[i]. Rays are independent, so they are spread
+// across threads; nothing is allocated per ray. The world must not change during the call.
+void CastRays (Voxels const& grid, RayQuery const* queries, int n, RayHit* hits)
+{
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(int i = 0; i < n; ++i)
+        hits[i] = CastRay(grid, queries[i]);
+}
+
+// Like CastRay, but also appends to traversed the air voxels the ray passes through before
+// the hit, in order, e.g. for edits along the ray. These are found with a plain voxel by voxel
+// walk, so rays are meant to be short.
+RayHit CastRay (Voxels const& grid, RayQuery const& q, std::vector<glm::ivec3>& traversed)
+{
+    RayHit hit = CastRay(grid, q);
+    float len = glm::length(q.dir);
+    if(len == 0)
+        return hit;
+    glm::vec3 dir = q.dir / len;
+
+    glm::ivec3 p(glm::floor(q.origin)), step;
+    glm::vec3 t_max, t_delta;
+    for(int a = 0; a < 3; ++a)
+    {
+        step[a] = dir[a] < 0 ? -1 : 1;
+        t_delta[a] = dir[a] != 0 ? std::abs(1 / dir[a]) : std::numeric_limits<float>::infinity();
+        t_max[a] = dir[a] != 0 ? (p[a] + (step[a] > 0) - q.origin[a]) / dir[a] : std::numeric_limits<float>::infinity();
+    }
+    // Stop at the hit voxel, or at any solid one in case rounding took the walk past an edge
+    // of it on another path than CastRay.
+    for(float t = 0; t < hit.dist && grid.Get(p) == eAir; )
+    {
+        traversed.push_back(p);
+        int a = t_max.x < t_max.y ? (t_max.x < t_max.z ? 0 : 2) : (t_max.y < t_max.z ? 1 : 2);
+        t = t_max[a];
+        p[a] += step[a];
+        t_max[a] += t_delta[a];
+    }
+    return hit;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "perlin.h"
+
+#include <cmath>
+#include <vector>
+
+// Simplex noise (Ken Perlin, 2001; as in Stefan Gustavson, "Simplex noise demystified"). Space is
+// split into simplices instead of cubes, so a 3D sample sums the radially decaying contributions
+// of the 4 corners of its tetrahedron rather than blending 8 cube corners, and a 4D sample 5
+// instead of 16. Seeded and thread-safe like Perlin3D, with the same kind of gradients, so the
+// two can be swapped.
+class Simplex3D
+{
+private:
+    uint32_t seed_;
+
+    // Scales the sum to about [-1, 1].
+    static constexpr float kScale = 32;
+
+    float Corner(glm::ivec3 const& i, glm::vec3 const& d) const
+    {
+        float t = 0.6f - glm::dot(d, d);
+        if(t <= 0)
+            return 0;
+        t *= t;
+        return t * t * glm::dot(GridGradient(HashGridPoint(i, seed_)), d);
+    }
+
+public:
+    explicit Simplex3D(uint32_t seed = 0)
+        : seed_{seed}
+    {}
+
+    uint32_t Seed() const {return seed_;}
+
+    float GetSimplex(glm::vec3 const& p) const
+    {
+        // Skew to find the cube of simplices p is in, unskew to get back to its corner.
+        constexpr float F3 = 1.0f / 3, G3 = 1.0f / 6;
+        glm::ivec3 i = glm::floor(p + (p.x + p.y + p.z) * F3);
+        glm::vec3 d0 = p - (glm::vec3(i) - float(i.x + i.y + i.z) * G3);
+
+        // The tetrahedron is picked by the order of the offset's coordinates.
+        glm::ivec3 i1, i2;
+        if(d0.x >= d0.y)
+        {
+            if(d0.y >= d0.z)      {i1 = {1, 0, 0}; i2 = {1, 1, 0};}
+            else if(d0.x >= d0.z) {i1 = {1, 0, 0}; i2 = {1, 0, 1};}
+            else                  {i1 = {0, 0, 1}; i2 = {1, 0, 1};}
+        }
+        else
+        {
+            if(d0.y < d0.z)       {i1 = {0, 0, 1}; i2 = {0, 1, 1};}
+            else if(d0.x < d0.z)  {i1 = {0, 1, 0}; i2 = {0, 1, 1};}
+            else                  {i1 = {0, 1, 0}; i2 = {1, 1, 0};}
+        }
+
+        glm::vec3 d1 = d0 - glm::vec3(i1) + G3;
+        glm::vec3 d2 = d0 - glm::vec3(i2) + 2 * G3;
+        glm::vec3 d3 = d0 - 1.0f + 3 * G3;
+        return kScale * (Corner(i, d0) + Corner(i + i1, d1) + Corner(i + i2, d2) + Corner(i + 1, d3));
+    }
+
+    // Noise at the n points (x[i], y[i], z[i]), written to out[i].
+    void GetSimplex(float const* x, float const* y, float const* z, float* out, int n) const
+    {
+        for(int i = 0; i < n; ++i)
+            out[i] = GetSimplex(glm::vec3(x[i], y[i], z[i]));
+    }
+
+    // Test on an NxNxN grid with K samples per k gridcell, as Perlin3D::Test.
+    std::vector<std::vector<std::vector<float>>> Test(int N, int K) const
+    {
+        std::vector<std::vector<std::vector<float>>> vals(N * K, std::vector<std::vector<float>>(N * K, std::vector<float>(N * K)));
+        float step = 1.0f / K;
+        for (int i0 = 0; i0 < N * K; ++i0)
+            for (int i1 = 0; i1 < N * K; ++i1)
+                for (int i2 = 0; i2 < N * K; ++i2)
+                    vals[i0][i1][i2] = GetSimplex({(i0 + 0.5f) * step, (i1 + 0.5f) * step, (i2 + 0.5f) * step});
+        return vals;
+    }
+};
+
+// 4D simplex noise, e.g. for 3D noise that changes smoothly over time. 5 corners per sample.
+class Simplex4D
+{
+private:
+    uint32_t seed_;
+
+    static constexpr float kScale = 27;
+
+    // The 32 gradients of 4D simplex noise: the midpoints of the edges of the tesseract, i.e. one
+    // coordinate zero and the other three +-1.
+    static glm::vec4 Gradient(uint32_t hash)
+    {
+        int h = hash & 31;
+        float a = (h & 1) ? -1 : 1, b = (h & 2) ? -1 : 1, c = (h & 4) ? -1 : 1;
+        switch(h >> 3)
+        {
+            case 0: return {0, a, b, c};
+            case 1: return {a, 0, b, c};
+            case 2: return {a, b, 0, c};
+            default: return {a, b, c, 0};
+        }
+    }
+
+    float Corner(glm::ivec4 const& i, glm::vec4 const& d) const
+    {
+        float t = 0.6f - glm::dot(d, d);
+        if(t <= 0)
+            return 0;
+        t *= t;
+        uint32_t h = MixHash(seed_ ^ uint32_t(i.x) * 73856093u ^ uint32_t(i.y) * 19349663u
+                             ^ uint32_t(i.z) * 83492791u ^ uint32_t(i.w) * 2654435761u);
+        return t * t * glm::dot(Gradient(h), d);
+    }
+
+public:
+    explicit Simplex4D(uint32_t seed = 0)
+        : seed_{seed}
+    {}
+
+    uint32_t Seed() const {return seed_;}
+
+    float GetSimplex(glm::vec4 const& p) const
+    {
+        const float F4 = (std::sqrt(5.0f) - 1) / 4, G4 = (5 - std::sqrt(5.0f)) / 20;
+        glm::ivec4 i = glm::floor(p + (p.x + p.y + p.z + p.w) * F4);
+        glm::vec4 d0 = p - (glm::vec4(i) - float(i.x + i.y + i.z + i.w) * G4);
+
+        // Rank the offset's coordinates. The simplex steps along the largest first: corner k has
+        // a 1 in every coordinate whose rank is at least 4 - k.
+        glm::ivec4 rank(0);
+        for(int a = 0; a < 4; ++a)
+            for(int b = a + 1; b < 4; ++b)
+                ++rank[d0[a] > d0[b] ? a : b];
+
+        float sum = Corner(i, d0);
+        for(int k = 1; k <= 4; ++k)
+        {
+            glm::ivec4 ik;
+            for(int a = 0; a < 4; ++a)
+                ik[a] = rank[a] >= 4 - k;
+            sum += Corner(i + ik, d0 - glm::vec4(ik) + float(k) * G4);
+        }
+        return kScale * sum;
+    }
+};
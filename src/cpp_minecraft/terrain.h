@@ -0,0 +1,157 @@
+#pragma once
+
+#include "voxels.h"
+#include "noise_expr.h"
+
+#include <vector>
+
+// Terrain generated one chunk at a time straight into its block storage. From the bottom up: a
+// layer of air at y = 0, stone where the density expression (see noise_expr.h) is at most 0,
+// grass from 90% of height up, and air from height - 5 up. Unbounded horizontally.
+// Uniform parts are detected before any voxel is sampled: layers outside the noise band are
+// filled whole, and regions of the band where the density bounds lie entirely on one side of 0
+// are filled without evaluating the density per voxel.
+template<class Density>
+struct BasicTerrain
+{
+    int height;
+    Density density; // Of world positions in voxels.
+
+    // Margin against the rounding difference between the bounds and the density itself.
+    static constexpr float kBoundsMargin = 1e-4f;
+    // Bounds are tested on cubes of this many voxels, then on their octants down to bricks.
+    static constexpr int kCellDim = 16;
+    static constexpr int kBrickVol = kBrickDim * kBrickDim * kBrickDim;
+
+    BasicTerrain (int height_, Density const& density_)
+        : height{height_}, density{density_}
+    {}
+
+    bool InNoiseBand (int y) const
+    {
+        return y >= 1 && y < height * 0.9 && y < height - 5;
+    }
+
+    bool InGrassBand (int y) const
+    {
+        return !InNoiseBand(y) && y >= 1 && y < height - 5;
+    }
+
+    // Fill chunk, which must be all air, with the terrain of chunk key. Rows are collected as
+    // masks and written with SetRow at the end. Thread-safe, and the result only depends on the
+    // seed and key, not on which thread or in which order chunks are generated.
+    void Generate (glm::ivec3 const& key, Chunk& chunk) const
+    {
+        glm::ivec3 origin = key * kChunkDim;
+        int noise_lo = kChunkDim, noise_hi = -1;
+        bool any_grass = false;
+        for(int ly = 0; ly < kChunkDim; ++ly)
+        {
+            if(InNoiseBand(origin.y + ly))
+            {
+                noise_lo = std::min(noise_lo, ly);
+                noise_hi = ly;
+            }
+            any_grass |= InGrassBand(origin.y + ly);
+        }
+        // All air.
+        if(noise_lo > noise_hi && !any_grass)
+            return;
+
+        std::vector<uint32_t> stone(kChunkDim * kChunkDim, 0);
+        if(noise_lo <= noise_hi)
+            for(int z = 0; z < kChunkDim; z += kCellDim)
+                for(int y = 0; y < kChunkDim; y += kCellDim)
+                    for(int x = 0; x < kChunkDim; x += kCellDim)
+                        GenerateRegion(origin, {x, y, z}, kCellDim, noise_lo, noise_hi, stone);
+
+        for(int z = 0; z < kChunkDim; ++z)
+            for(int y = 0; y < kChunkDim; ++y)
+            {
+                int row = Chunk::RowIdx(y, z);
+                if(InGrassBand(origin.y + y))
+                    chunk.SetRow(row, ~0u, eGrass);
+                else
+                    chunk.SetRow(row, stone[row], eStone);
+            }
+        chunk.Compact();
+    }
+
+private:
+    // Set the stone bits of the cube of dim voxels at local position lo, limited to the noise
+    // layers [noise_lo, noise_hi]. Regions are split in eight until the noise bounds decide them
+    // or they are brick sized, at which point the voxels are sampled one by one.
+    void GenerateRegion (glm::ivec3 const& origin, glm::ivec3 const& lo, int dim,
+                         int noise_lo, int noise_hi, std::vector<uint32_t>& stone) const
+    {
+        int y0 = std::max(lo.y, noise_lo), y1 = std::min(lo.y + dim - 1, noise_hi);
+        if(y0 > y1)
+            return;
+
+        // Bounds over the voxel centers, which is where the density is sampled.
+        glm::vec3 p_lo = glm::vec3(origin.x + lo.x, origin.y + y0, origin.z + lo.z) + 0.5f;
+        glm::vec3 p_hi = glm::vec3(origin.x + lo.x + dim - 1, origin.y + y1, origin.z + lo.z + dim - 1) + 0.5f;
+        glm::vec2 range = density.Bounds(p_lo, p_hi);
+        if(range.x > kBoundsMargin)
+            return;
+        if(range.y < -kBoundsMargin)
+        {
+            uint32_t mask = SpanBits(lo.x, dim);
+            for(int z = lo.z; z < lo.z + dim; ++z)
+                for(int y = y0; y <= y1; ++y)
+                    stone[Chunk::RowIdx(y, z)] |= mask;
+            return;
+        }
+
+        if(dim > kBrickDim)
+        {
+            int half = dim / 2;
+            for(int z = 0; z < dim; z += half)
+                for(int y = 0; y < dim; y += half)
+                    for(int x = 0; x < dim; x += half)
+                        GenerateRegion(origin, lo + glm::ivec3(x, y, z), half, noise_lo, noise_hi, stone);
+            return;
+        }
+
+        // Sample the whole brick in one batch.
+        float px[kBrickVol], py[kBrickVol], pz[kBrickVol], values[kBrickVol];
+        int n = 0;
+        for(int z = lo.z; z < lo.z + dim; ++z)
+            for(int y = y0; y <= y1; ++y)
+                for(int x = lo.x; x < lo.x + dim; ++x, ++n)
+                {
+                    px[n] = origin.x + x + 0.5f;
+                    py[n] = origin.y + y + 0.5f;
+                    pz[n] = origin.z + z + 0.5f;
+                }
+        density.Eval(px, py, pz, values, n);
+
+        n = 0;
+        for(int z = lo.z; z < lo.z + dim; ++z)
+            for(int y = y0; y <= y1; ++y)
+            {
+                uint32_t& row = stone[Chunk::RowIdx(y, z)];
+                for(int x = lo.x; x < lo.x + dim; ++x, ++n)
+                    if(values[n] <= 0)
+                        row |= 1u << x;
+            }
+    }
+
+    static uint32_t SpanBits (int x, int n)
+    {
+        return (n >= 32 ? ~0u : (1u << n) - 1) << x;
+    }
+};
+
+// The default terrain: stone where Perlin noise over cells of 16 voxels is at most 0.15.
+using DefaultDensity = expr::Difference<expr::Noise, expr::Constant>;
+
+struct Terrain : BasicTerrain<DefaultDensity>
+{
+    static constexpr float kNoiseScale = 1 / 16.0f; // Noise grid cells per voxel.
+    static constexpr float kStoneThreshold = 0.15f;
+
+    Terrain (int height_, uint32_t seed)
+        : BasicTerrain(height_, expr::Noise(Perlin3D(seed), kNoiseScale) - kStoneThreshold)
+    {}
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "voxels.h"
+
+#include <algorithm>
+#include <vector>
+
+// Cave culling (Tommaso Checchi, "Advanced cave culling algorithm", 2014). Each chunk records
+// which pairs of its faces are connected through air. A breadth first search from the camera's
+// chunk then only enters a chunk through a face it can be seen through, so the caves and tunnels
+// behind solid terrain are never reached and not drawn.
+
+// Bit of the pair of faces a != b (numbered as g_faceNormalAxis) in a connectivity mask.
+inline int FacePairBit (int a, int b)
+{
+    if(a > b)
+        std::swap(a, b);
+    // Pairs (0, 1..5) are bits 0-4, (1, 2..5) bits 5-8, and so on.
+    return a * (11 - a) / 2 + b - a - 1;
+}
+
+constexpr uint16_t kAllFacesConnected = (1 << 15) - 1;
+
+inline bool FacesConnected (uint16_t connectivity, int a, int b)
+{
+    return connectivity >> FacePairBit(a, b) & 1;
+}
+
+// The voxels of a row that are connected to seeds through the set bits of open, which must
+// include the seeds: the runs of open containing a seed, filled in both directions with
+// Kogge-Stone steps.
+inline uint32_t FillRuns (uint32_t seeds, uint32_t open)
+{
+    uint32_t up = seeds, up_open = open;
+    uint32_t down = seeds, down_open = open;
+    for(int shift = 1; shift < kChunkDim; shift *= 2)
+    {
+        up |= up_open & (up << shift);
+        up_open &= up_open << shift;
+        down |= down_open & (down >> shift);
+        down_open &= down_open >> shift;
+    }
+    return up | down;
+}
+
+// Which pairs of faces of chunk are connected through air. The air is flood filled a row at a
+// time, starting from each air voxel on the border the fill has not reached yet. The faces each
+// fill touches are all connected to each other.
+uint16_t FaceConnectivity (Chunk const& chunk)
+{
+    if(chunk.solid_count == 0)
+        return kAllFacesConnected;
+
+    constexpr int kNumRows = kChunkDim * kChunkDim;
+    std::vector<uint32_t> open(kNumRows), seen(kNumRows, 0), pending(kNumRows, 0);
+    for(int row = 0; row < kNumRows; ++row)
+        open[row] = ~chunk.OccupancyRow(row);
+    std::vector<int> stack;
+
+    uint16_t connectivity = 0;
+    for(int seed_row = 0; seed_row < kNumRows && connectivity != kAllFacesConnected; ++seed_row)
+    {
+        int y = seed_row & kChunkMask, z = seed_row >> kChunkBits;
+        bool on_border = y == 0 || y == kChunkMask || z == 0 || z == kChunkMask;
+        uint32_t border = on_border ? ~0u : 1u | 1u << kChunkMask;
+        for(uint32_t seeds; (seeds = open[seed_row] & border & ~seen[seed_row]) != 0;)
+        {
+            // Fill the air reachable from the lowest unreached seed, noting the faces it touches.
+            int faces = 0;
+            pending[seed_row] = seeds & (0u - seeds);
+            stack.push_back(seed_row);
+            while(!stack.empty())
+            {
+                int row = stack.back();
+                stack.pop_back();
+                uint32_t span = FillRuns(pending[row], open[row] & ~seen[row]);
+                pending[row] = 0;
+                seen[row] |= span;
+
+                int ry = row & kChunkMask, rz = row >> kChunkBits;
+                faces |= (span & 1) << 0 | (span >> kChunkMask) << 1;
+                faces |= (ry == 0) << 2 | (ry == kChunkMask) << 3 | (rz == 0) << 4 | (rz == kChunkMask) << 5;
+
+                int neighbours[4] = {ry > 0 ? row - 1 : -1, ry < kChunkMask ? row + 1 : -1,
+                                     rz > 0 ? row - kChunkDim : -1, rz < kChunkMask ? row + kChunkDim : -1};
+                for(int nb: neighbours)
+                {
+                    if(nb < 0)
+                        continue;
+                    uint32_t reached = span & open[nb] & ~seen[nb] & ~pending[nb];
+                    if(!reached)
+                        continue;
+                    if(!pending[nb])
+                        stack.push_back(nb);
+                    pending[nb] |= reached;
+                }
+            }
+
+            for(int a = 0; a < 6; ++a)
+                for(int b = a + 1; b < 6; ++b)
+                    if((faces >> a & 1) && (faces >> b & 1))
+                        connectivity |= 1 << FacePairBit(a, b);
+        }
+    }
+    return connectivity;
+}
+
+// Any chunk may be in view.
+struct AllInView
+{
+    bool operator() (glm::ivec3 const&) const {return true;}
+};
+
+// Append to visible the chunks in the box [lo, hi] of chunk keys that may be seen from the
+// camera chunk start, which is clamped to the box. connectivity(key) gives the face connectivity
+// of chunk key; chunks without one, e.g. unallocated air or not yet meshed, should be given
+// kAllFacesConnected. The search never steps against a direction it has already stepped in, so
+// it can only reach chunks through a path of faces that a line of sight could cross. Chunks for
+// which in_view(key) is false, e.g. outside the view frustum, are neither entered nor searched
+// through, since a line of sight from the camera does not leave the frustum and come back.
+template<class Connectivity, class InView = AllInView>
+void FindVisibleChunks (glm::ivec3 start, glm::ivec3 const& lo, glm::ivec3 const& hi,
+                        Connectivity const& connectivity, std::vector<glm::ivec3>& visible,
+                        InView const& in_view = InView())
+{
+    start = glm::clamp(start, lo, hi);
+    glm::ivec3 size = hi - lo + 1;
+    auto index = [&](glm::ivec3 const& key)
+    {
+        glm::ivec3 p = key - lo;
+        return (p.z * size.y + p.y) * size.x + p.x;
+    };
+
+    struct Step
+    {
+        glm::ivec3 key;
+        int entered; // The face the search came in through, or -1 at the start.
+        int dirs;    // Bit f is set if the path to here stepped out through face f.
+    };
+    std::vector<uint8_t> visited(size_t(size.x) * size.y * size.z, 0);
+    std::vector<Step> queue;
+    queue.push_back({start, -1, 0});
+    visited[index(start)] = 1;
+    for(size_t head = 0; head < queue.size(); ++head)
+    {
+        Step s = queue[head];
+        visible.push_back(s.key);
+        uint16_t conn = s.entered < 0 ? kAllFacesConnected : connectivity(s.key);
+        for(int face = 0; face < 6; ++face)
+        {
+            // Faces are paired as negative, positive along each axis, so face ^ 1 is opposite.
+            if(s.dirs >> (face ^ 1) & 1)
+                continue;
+            if(s.entered >= 0 && (s.entered == face || !FacesConnected(conn, s.entered, face)))
+                continue;
+            int axis = g_faceNormalAxis[face];
+            glm::ivec3 nb = s.key;
+            nb[axis] += (face & 1) ? 1 : -1;
+            if(nb[axis] < lo[axis] || nb[axis] > hi[axis] || visited[index(nb)])
+                continue;
+            visited[index(nb)] = 1;
+            if(!in_view(nb))
+                continue;
+            queue.push_back({nb, face ^ 1, s.dirs | 1 << face});
+        }
+    }
+}
@@ -1,197 +1,851 @@
-#pragma once 
+#pragma once
 
 #include "custom_shape.h"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 
-enum Block : int
+enum Block : uint8_t
 {
     eWood=0, ePumpkin, eLava, eLavaPartial, eWater, eWaterPartial, eDirt, eGrass, eStone, eAir, eCount
 };
 
-struct Voxels 
+// The world is split into cubic chunks of kChunkDim^3 voxels.
+// kChunkDim must be a power of two so that world coordinates can be split with shifts and masks.
+constexpr int kChunkBits = 5;
+constexpr int kChunkDim = 1 << kChunkBits;
+constexpr int kChunkMask = kChunkDim - 1;
+constexpr int kChunkVol = kChunkDim * kChunkDim * kChunkDim;
+static_assert(kChunkDim <= 32, "Chunk occupancy rows are stored in 32 bit words");
+
+// Chunks are further split into bricks of kBrickDim^3 voxels, each with an "any solid" bit, 
+// so that queries can skip empty space a brick at a time.
+constexpr int kBrickBits = 2;
+constexpr int kBrickDim = 1 << kBrickBits;
+constexpr int kChunkBricks = kChunkDim / kBrickDim; // Bricks along each axis of a chunk.
+static_assert(kChunkBricks * kChunkBricks <= 64, "A z-slice of brick bits is stored in a 64 bit word");
+
+inline int CountTrailingZeros (uint32_t v)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, v);
+    return idx;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
+inline int CountLeadingZeros (uint32_t v)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanReverse(&idx, v);
+    return 31 - idx;
+#else
+    return __builtin_clz(v);
+#endif
+}
+
+inline int PopCount (uint32_t v)
 {
-    int Nx, Ny, Nz;
-    std::vector<Block> data;
+#ifdef _MSC_VER
+    return __popcnt(v);
+#else
+    return __builtin_popcount(v);
+#endif
+}
+
+// Blocks of a chunk are palette compressed: each voxel stores an index into a small palette
+// of the block types present in the chunk, packed at 1, 2, 4 or 8 bits per voxel. The index 
+// width grows automatically when a new type is written. A chunk of a single type stores no 
+// indices at all (bits == 0), just the one palette entry.
+struct Chunk
+{
+    std::vector<Block> palette;
+    std::vector<uint32_t> indices; // Packed palette indices, empty while bits == 0.
+    int bits;                      // 0, 1, 2, 4 or 8 bits per voxel.
+    int log_bits;                  // log2(bits) when bits > 0, so indices are found with shifts.
+    int solid_count;               // Number of non-air voxels. A chunk with none is freed.
+
+    // One bit per voxel, set if it is not air. Word RowIdx(y, z) holds the row of voxels
+    // along x, with bit x for voxel (x, y, z). Kept in sync by Set. Empty for uniform chunks.
+    std::vector<uint32_t> occupancy;
 
-    Voxels (int Nx_, int Ny_, int Nz_)
-        : Nx{Nx_}, Ny{Ny_}, Nz{Nz_}, data(Nx_*Ny_*Nz_, eAir)
+    // One bit per brick, set if any voxel in it is not air. Word bz holds bit bx + kChunkBricks * by
+    // for brick (bx, by, bz). Kept in sync by Set.
+    uint64_t bricks[kChunkBricks];
+
+    Chunk ()
+        : palette{eAir}, bits{0}, log_bits{0}, solid_count{0}, bricks{}
     {}
 
-    int GetIdx (int x, int y, int z) const
+    static int GetIdx (int x, int y, int z)
+    {
+        return x + kChunkDim * (y + kChunkDim * z);
+    }
+
+    static int RowIdx (int y, int z)
     {
-        return x + Nx * (y + Ny * z);
+        return y + kChunkDim * z;
     }
 
-    int GetIdx (glm::ivec3 const& p) const
+    Block Get (int idx) const
     {
-        return p.x + Nx * (p.y + Ny * p.z);
+        return palette[GetIndex(idx)];
     }
 
-    glm::ivec3 CastRay (glm::ivec3 pos_vox, glm::vec3 const& dir, glm::ivec3& vox_prev, std::vector<glm::ivec3>& voxs) 
+    Block Get (int x, int y, int z) const
     {
-        // See http://www.cse.yorku.ca/~amana/research/grid.pdf.
-        glm::ivec3 pos_vox_init = pos_vox;
-        vox_prev = pos_vox;
-        glm::ivec3 step = glm::ivec3(dir.x > 0, dir.y > 0, dir.z > 0) * 2 - 1;
-        
-        while(data[GetIdx(pos_vox)] == eAir)
+        return Get(GetIdx(x, y, z));
+    }
+
+    bool BrickSolid (int bx, int by, int bz) const
+    {
+        return (bricks[bz] >> (bx + kChunkBricks * by)) & 1;
+    }
+
+    uint32_t OccupancyRow (int row) const
+    {
+        if(occupancy.empty())
+            return palette[0] != eAir ? ~0u >> (32 - kChunkDim) : 0;
+        return occupancy[row];
+    }
+
+    void Set (int idx, Block v)
+    {
+        Block old = Get(idx);
+        if(old == v)
+            return;
+        solid_count += (v != eAir) - (old != eAir);
+
+        int pal_idx = std::find(palette.begin(), palette.end(), v) - palette.begin();
+        if(pal_idx == (int)palette.size())
         {
-            vox_prev = pos_vox;
-            voxs.push_back(pos_vox);
-            // Distance in is just distance along each dimension divided by component in each dimension.
-            // Note that we should really normalize dir and scale this while thing by scale. 
-            // But it doesn't matter! Distance comparisons still work all the same!
-            glm::vec3 distNext = glm::abs(glm::vec3(pos_vox + step - pos_vox_init) / dir); 
-
-            // Move in direction of minimum distance. 
-            if(distNext.x < distNext.y)
+            palette.push_back(v);
+            if(palette.size() > (1u << bits))
+                Repack(bits == 0 ? 0 : log_bits + 1);
+        }
+        SetIndex(idx, pal_idx);
+
+        if(occupancy.empty())
+        {
+            uint32_t row = OccupancyRow(0);
+            occupancy.assign(kChunkDim * kChunkDim, row);
+        }
+        // idx >> kChunkBits is the row index, the low bits are x.
+        uint32_t bit = 1u << (idx & kChunkMask);
+        if(v != eAir)
+            occupancy[idx >> kChunkBits] |= bit;
+        else
+            occupancy[idx >> kChunkBits] &= ~bit;
+
+        int x = idx & kChunkMask, y = (idx >> kChunkBits) & kChunkMask, z = idx >> (2 * kChunkBits);
+        uint64_t& brick_word = bricks[z >> kBrickBits];
+        uint64_t brick_bit = uint64_t(1) << ((x >> kBrickBits) + kChunkBricks * (y >> kBrickBits));
+        if(v != eAir)
+            brick_word |= brick_bit;
+        else if(old != eAir)
+        {
+            // The brick stays solid if any of its rows still has a voxel in it.
+            int x0 = x & ~(kBrickDim - 1), y0 = y & ~(kBrickDim - 1), z0 = z & ~(kBrickDim - 1);
+            uint32_t x_mask = ((1u << kBrickDim) - 1) << x0;
+            uint32_t any = 0;
+            for(int bz = z0; bz < z0 + kBrickDim; ++bz)
+                for(int by = y0; by < y0 + kBrickDim; ++by)
+                    any |= occupancy[RowIdx(by, bz)] & x_mask;
+            if(!any)
+                brick_word &= ~brick_bit;
+        }
+    }
+
+    // Set the voxels of row `row` (see RowIdx) whose bit is set in mask to v. The palette
+    // lookup and the occupancy and count updates are done once for the whole row. Returns the
+    // bits of the voxels that actually changed. Brick bits are set for new solid voxels, but
+    // clearing voxels leaves their bricks marked until RefreshBricks is called.
+    uint32_t SetRow (int row, uint32_t mask, Block v)
+    {
+        if(!mask || (bits == 0 && palette[0] == v))
+            return 0;
+
+        int pal_idx = std::find(palette.begin(), palette.end(), v) - palette.begin();
+        if(pal_idx == (int)palette.size())
+        {
+            palette.push_back(v);
+            if(palette.size() > (1u << bits))
+                Repack(bits == 0 ? 0 : log_bits + 1);
+        }
+
+        uint32_t changed = 0;
+        int base = row << kChunkBits;
+        for(uint32_t m = mask; m; m &= m - 1)
+        {
+            int x = CountTrailingZeros(m);
+            if(GetIndex(base + x) != pal_idx)
             {
-                if(distNext.x < distNext.z)
-                {
-                    pos_vox.x += step.x;
-                    if((dir.x > 0 && pos_vox.x > Nx - 1) || (dir.x <= 0 && pos_vox.x < 0))
-                        break;
-                }
-                else
+                SetIndex(base + x, pal_idx);
+                changed |= 1u << x;
+            }
+        }
+        if(!changed)
+            return 0;
+
+        if(occupancy.empty())
+        {
+            uint32_t full = OccupancyRow(0);
+            occupancy.assign(kChunkDim * kChunkDim, full);
+        }
+        uint32_t& occ = occupancy[row];
+        solid_count -= PopCount(occ & changed);
+        if(v != eAir)
+        {
+            occ |= changed;
+            solid_count += PopCount(changed);
+
+            int y = row & kChunkMask, z = row >> kChunkBits;
+            uint64_t& brick_word = bricks[z >> kBrickBits];
+            for(uint32_t m = changed; m; m &= m - 1)
+                brick_word |= uint64_t(1) << ((CountTrailingZeros(m) >> kBrickBits) + kChunkBricks * (y >> kBrickBits));
+        }
+        else
+            occ &= ~changed;
+        return changed;
+    }
+
+    // Recompute the brick bits of the bricks overlapping the local box [lo, hi] (inclusive).
+    void RefreshBricks (glm::ivec3 const& lo, glm::ivec3 const& hi)
+    {
+        for(int bz = lo.z >> kBrickBits; bz <= hi.z >> kBrickBits; ++bz)
+            for(int by = lo.y >> kBrickBits; by <= hi.y >> kBrickBits; ++by)
+            {
+                uint32_t rows = 0;
+                for(int z = bz << kBrickBits; z < (bz + 1) << kBrickBits; ++z)
+                    for(int y = by << kBrickBits; y < (by + 1) << kBrickBits; ++y)
+                        rows |= OccupancyRow(RowIdx(y, z));
+                for(int bx = lo.x >> kBrickBits; bx <= hi.x >> kBrickBits; ++bx)
                 {
-                    pos_vox.z += step.z;
-                    if((dir.z > 0 && pos_vox.z > Nx - 1) || (dir.z <= 0 && pos_vox.z < 0))
-                        break;
+                    uint64_t bit = uint64_t(1) << (bx + kChunkBricks * by);
+                    if(rows & (((1u << kBrickDim) - 1) << (bx << kBrickBits)))
+                        bricks[bz] |= bit;
+                    else
+                        bricks[bz] &= ~bit;
                 }
             }
+    }
+
+    // Drop palette entries that are no longer used and shrink the index width to match.
+    // A chunk left with a single block type collapses to a uniform chunk.
+    void Compact ()
+    {
+        if(bits == 0)
+            return;
+
+        std::vector<int> remap(palette.size(), -1);
+        std::vector<Block> used;
+        for(int i = 0; i < kChunkVol; ++i)
+        {
+            int pal_idx = GetIndex(i);
+            if(remap[pal_idx] < 0)
+            {
+                remap[pal_idx] = used.size();
+                used.push_back(palette[pal_idx]);
+            }
+        }
+
+        if(used.size() == 1)
+        {
+            palette = used;
+            bits = log_bits = 0;
+            indices.clear();
+            indices.shrink_to_fit();
+            occupancy.clear();
+            occupancy.shrink_to_fit();
+            return;
+        }
+
+        int new_log_bits = 0;
+        while((1u << (1 << new_log_bits)) < used.size())
+            ++new_log_bits;
+
+        std::vector<int> old(kChunkVol);
+        for(int i = 0; i < kChunkVol; ++i)
+            old[i] = remap[GetIndex(i)];
+        palette = used;
+        SetWidth(new_log_bits);
+        for(int i = 0; i < kChunkVol; ++i)
+            SetIndex(i, old[i]);
+    }
+
+    size_t MemoryBytes () const
+    {
+        return sizeof(Chunk) + palette.capacity() * sizeof(Block)
+            + (indices.capacity() + occupancy.capacity()) * sizeof(uint32_t);
+    }
+
+private:
+    int GetIndex (int idx) const
+    {
+        if(bits == 0)
+            return 0;
+        // 32 >> log_bits indices per word, each bits wide.
+        uint32_t word = indices[idx >> (5 - log_bits)];
+        int shift = (idx & ((32 >> log_bits) - 1)) << log_bits;
+        return (word >> shift) & ((1u << bits) - 1);
+    }
+
+    void SetIndex (int idx, int pal_idx)
+    {
+        uint32_t& word = indices[idx >> (5 - log_bits)];
+        int shift = (idx & ((32 >> log_bits) - 1)) << log_bits;
+        word = (word & ~(((1u << bits) - 1) << shift)) | uint32_t(pal_idx) << shift;
+    }
+
+    // Switch to 1 << new_log_bits bits per voxel, with all indices zeroed.
+    void SetWidth (int new_log_bits)
+    {
+        log_bits = new_log_bits;
+        bits = 1 << new_log_bits;
+        indices.assign(kChunkVol >> (5 - log_bits), 0);
+        indices.shrink_to_fit();
+    }
+
+    // Widen every index to 1 << new_log_bits bits per voxel.
+    void Repack (int new_log_bits)
+    {
+        std::vector<int> old(kChunkVol);
+        for(int i = 0; i < kChunkVol; ++i)
+            old[i] = GetIndex(i);
+        SetWidth(new_log_bits);
+        for(int i = 0; i < kChunkVol; ++i)
+            SetIndex(i, old[i]);
+    }
+};
+
+struct ChunkHash
+{
+    size_t operator() (glm::ivec3 const& k) const
+    {
+        // Primes from Teschner et al., "Optimized Spatial Hashing for Collision Detection of Deformable Objects".
+        return size_t(unsigned(k.x) * 73856093u ^ unsigned(k.y) * 19349663u ^ unsigned(k.z) * 83492791u);
+    }
+};
+
+// Unbounded voxel world. Only chunks containing at least one non-air voxel are allocated,
+// everything else reads as air.
+struct Voxels
+{
+    std::unordered_map<glm::ivec3, Chunk, ChunkHash> chunks;
+
+    // Bounding box (in chunk coordinates, inclusive) of every chunk ever allocated.
+    // Rays are terminated once they leave it.
+    glm::ivec3 chunk_min{0}, chunk_max{-1};
+
+    // Chunks whose mesh is out of date. Filled by Set, consumed by whoever owns the meshes.
+    std::unordered_set<glm::ivec3, ChunkHash> dirty_chunks;
+
+    // Chunks changed since they were last saved. Filled by Set, consumed by WorldStore::SaveAsync.
+    std::unordered_set<glm::ivec3, ChunkHash> unsaved_chunks;
+
+    // Chunk containing world voxel p. Relies on arithmetic shift so negative coordinates floor.
+    static glm::ivec3 ChunkOf (glm::ivec3 const& p)
+    {
+        return {p.x >> kChunkBits, p.y >> kChunkBits, p.z >> kChunkBits};
+    }
+
+    // Index of world voxel p inside the data of chunk ChunkOf(p).
+    static int GetIdx (int x, int y, int z)
+    {
+        return Chunk::GetIdx(x & kChunkMask, y & kChunkMask, z & kChunkMask);
+    }
+
+    static int GetIdx (glm::ivec3 const& p)
+    {
+        return GetIdx(p.x, p.y, p.z);
+    }
+
+    bool Empty () const {return chunk_max.x < chunk_min.x;}
+
+    Chunk const* FindChunk (glm::ivec3 const& key) const
+    {
+        auto it = chunks.find(key);
+        return it == chunks.end() ? nullptr : &it->second;
+    }
+
+    Chunk* FindChunk (glm::ivec3 const& key)
+    {
+        auto it = chunks.find(key);
+        return it == chunks.end() ? nullptr : &it->second;
+    }
+
+    Chunk& GetOrCreateChunk (glm::ivec3 const& key)
+    {
+        if(Empty())
+        {
+            chunk_min = chunk_max = key;
+        }
+        else
+        {
+            chunk_min = glm::min(chunk_min, key);
+            chunk_max = glm::max(chunk_max, key);
+        }
+        return chunks[key];
+    }
+
+    // Mark the chunk containing p as needing a remesh and a save. Voxels on a chunk border also 
+    // affect the faces of the face-adjacent chunk, so that one is marked for a remesh too.
+    void MarkDirty (glm::ivec3 const& p)
+    {
+        glm::ivec3 key = ChunkOf(p);
+        dirty_chunks.insert(key);
+        unsaved_chunks.insert(key);
+        for(int ax = 0; ax < 3; ++ax)
+        {
+            int local = p[ax] & kChunkMask;
+            glm::ivec3 nb = key;
+            if(local == 0)
+                nb[ax] -= 1;
+            else if(local == kChunkMask)
+                nb[ax] += 1;
+            else
+                continue;
+            dirty_chunks.insert(nb);
+        }
+    }
+
+    void MarkAllDirty ()
+    {
+        for(auto const& kv: chunks)
+            dirty_chunks.insert(kv.first);
+    }
+
+    Block Get (glm::ivec3 const& p) const
+    {
+        Chunk const* c = FindChunk(ChunkOf(p));
+        return c ? c->Get(GetIdx(p)) : eAir;
+    }
+
+    Block Get (int x, int y, int z) const
+    {
+        return Get(glm::ivec3(x, y, z));
+    }
+
+    // Returns whether the voxel changed.
+    bool Set (glm::ivec3 const& p, Block v)
+    {
+        glm::ivec3 key = ChunkOf(p);
+        Chunk* c = FindChunk(key);
+        if(!c)
+        {
+            // Writing air into unallocated space is a no-op.
+            if(v == eAir)
+                return false;
+            c = &GetOrCreateChunk(key);
+        }
+        int idx = GetIdx(p);
+        if(c->Get(idx) == v)
+            return false;
+        c->Set(idx, v);
+        MarkDirty(p);
+        if(c->solid_count == 0)
+            chunks.erase(key);
+        return true;
+    }
+
+    // Free chunks that contain only air, e.g. after filling preallocated chunks, and shrink 
+    // the palettes of the others.
+    void Compact ()
+    {
+        for(auto it = chunks.begin(); it != chunks.end();)
+        {
+            if(it->second.solid_count == 0)
+            {
+                it = chunks.erase(it);
+            }
             else
             {
-                if(distNext.y < distNext.z)
-                {
-                    pos_vox.y += step.y;
-                    if((dir.y > 0 && pos_vox.y > Nx - 1) || (dir.y <= 0 && pos_vox.y < 0))
-                        break;
-                }
-                else 
-                {
-                    pos_vox.z += step.z;
-                    if((dir.z > 0 && pos_vox.z > Nx - 1) || (dir.z <= 0 && pos_vox.z < 0))
-                        break;
-                }
+                it->second.Compact();
+                ++it;
             }
         }
-        return pos_vox;
+    }
+
+    size_t MemoryBytes () const
+    {
+        size_t bytes = sizeof(Voxels);
+        for(auto const& kv: chunks)
+            bytes += sizeof(kv) + kv.second.MemoryBytes();
+        return bytes;
+    }
+
+    // Whether any voxel in the box [lo, hi] (inclusive) is not air. Unallocated chunks and empty
+    // bricks are skipped without looking at their voxels.
+    bool AnySolid (glm::ivec3 const& lo, glm::ivec3 const& hi) const
+    {
+        glm::ivec3 key_lo = ChunkOf(lo), key_hi = ChunkOf(hi);
+        for(int cz = key_lo.z; cz <= key_hi.z; ++cz)
+            for(int cy = key_lo.y; cy <= key_hi.y; ++cy)
+                for(int cx = key_lo.x; cx <= key_hi.x; ++cx)
+                {
+                    glm::ivec3 key(cx, cy, cz);
+                    Chunk const* c = FindChunk(key);
+                    if(!c)
+                        continue;
+
+                    // Box in chunk-local coordinates.
+                    glm::ivec3 origin = key * kChunkDim;
+                    glm::ivec3 l_lo = glm::max(lo - origin, glm::ivec3(0));
+                    glm::ivec3 l_hi = glm::min(hi - origin, glm::ivec3(kChunkMask));
+                    uint32_t x_mask = (~0u >> (31 - l_hi.x)) & (~0u << l_lo.x);
+                    for(int bz = l_lo.z >> kBrickBits; bz <= l_hi.z >> kBrickBits; ++bz)
+                        for(int by = l_lo.y >> kBrickBits; by <= l_hi.y >> kBrickBits; ++by)
+                            for(int bx = l_lo.x >> kBrickBits; bx <= l_hi.x >> kBrickBits; ++bx)
+                            {
+                                if(!c->BrickSolid(bx, by, bz))
+                                    continue;
+                                uint32_t b_mask = x_mask & (((1u << kBrickDim) - 1) << (bx << kBrickBits));
+                                int z0 = std::max(l_lo.z, bz << kBrickBits), z1 = std::min(l_hi.z, (bz << kBrickBits) + kBrickDim - 1);
+                                int y0 = std::max(l_lo.y, by << kBrickBits), y1 = std::min(l_hi.y, (by << kBrickBits) + kBrickDim - 1);
+                                for(int z = z0; z <= z1; ++z)
+                                    for(int y = y0; y <= y1; ++y)
+                                        if(c->OccupancyRow(Chunk::RowIdx(y, z)) & b_mask)
+                                            return true;
+                            }
+                }
+        return false;
     }
 };
 
-void SetSquare (Voxels& grid, glm::ivec3 const& coord, int len=1, Block v = eAir)
+// Writes made while the world is being read, i.e. by the block update tick (BlockUpdates::Tick).
+// They are recorded in order and applied at a single commit point, so every read in the tick sees
+// the world as it was at the start of it and the cost of a tick is proportional to the number of
+// writes rather than to the size of the world.
+struct VoxelChanges
 {
-    glm::ivec3 mx = coord + len;
-    mx = glm::min(mx, glm::ivec3(grid.Nx, grid.Ny, grid.Nz));
-    for(int z = coord.z; z < mx.z; ++z)
-        for(int y = coord.y; y < mx.y; ++y)
-            for(int x = coord.x; x < mx.x; ++x)
-                grid.data[grid.GetIdx(x,y,z)] = v;
-}
+    std::vector<std::pair<glm::ivec3, Block>> writes;
+
+    void Set (glm::ivec3 const& p, Block v)
+    {
+        writes.emplace_back(p, v);
+    }
+
+    bool Empty () const
+    {
+        return writes.empty();
+    }
+
+    // Apply the writes in the order they were made (the last write to a voxel wins).
+    void Commit (Voxels& grid)
+    {
+        Commit(grid, [](glm::ivec3 const&) {});
+    }
+
+    // Same, calling on_change(p) for every write that actually changed voxel p.
+    template<typename F>
+    void Commit (Voxels& grid, F on_change)
+    {
+        for(auto const& w: writes)
+            if(grid.Set(w.first, w.second))
+                on_change(w.first);
+        writes.clear();
+    }
+};
 
 // Lookup sprite index given block type and face (one of 0 through 5).
 // Indexed by blockType * 6 + faceIdx.
 // faceIdx indexing is: LEFT, RIGHT, BOTTOM, TOP, BACK, FRONT
-static int g_blockFaceSpriteLookup [] = 
+static int g_blockFaceSpriteLookup [] =
 {
-      16 ,   16,   16,   16,   16,   16,    
+      16 ,   16,   16,   16,   16,   16,
       17 ,   17,  113,  113,   17,  464,
-      0  ,  0  ,  0  ,  0  ,  0  ,  0  ,   
-      0  ,  0  ,  0  ,  0  ,  0  ,  0  ,   
-      2  ,  2  ,  2  ,  2  ,  2  ,  2  ,   
-      2  ,  2  ,  2  ,  2  ,  2  ,  2  ,   
-      162,  162,  162,  162,  162,  162,   
-      332,  332,  162,  607,  332,  332,   
-      308,  308,  308,  308,  308,  308,   
+      0  ,  0  ,  0  ,  0  ,  0  ,  0  ,
+      0  ,  0  ,  0  ,  0  ,  0  ,  0  ,
+      2  ,  2  ,  2  ,  2  ,  2  ,  2  ,
+      2  ,  2  ,  2  ,  2  ,  2  ,  2  ,
+      162,  162,  162,  162,  162,  162,
+      332,  332,  162,  607,  332,  332,
+      308,  308,  308,  308,  308,  308,
       606,  606,  606,  606,  605,  606,
-      602,  602,  602,  602,  602,  602,   
+      602,  602,  602,  602,  602,  602,
 };
 
-void Voxelize(Voxels const& grid, 
-        std::vector<unsigned>& indices, std::vector<MeshPoint>& points)
+// Per face (same indexing as above): the axis of the normal, the two in-plane axes along which
+// u and v run, and the order in which the (u, v) corners of the quad are emitted.
+static int const g_faceNormalAxis [6] = {0, 0, 1, 1, 2, 2};
+static int const g_faceUAxis [6] = {2, 2, 0, 0, 0, 0};
+static int const g_faceVAxis [6] = {1, 1, 2, 2, 1, 1};
+static int const g_faceCorners [6][4][2] =
 {
-    // Note that resize to zero does not change capacity. Therefore, 
-    // although we call emplace_back a bunch here, if we run this function 
-    // a lot, the emplace_back will be constant time.
-    indices.resize(0);
-    points.resize(0);
+    {{0,0}, {1,0}, {1,1}, {0,1}},
+    {{0,0}, {1,0}, {1,1}, {0,1}},
+    {{0,0}, {0,1}, {1,1}, {1,0}},
+    {{0,0}, {0,1}, {1,1}, {1,0}},
+    {{0,0}, {0,1}, {1,1}, {1,0}},
+    {{0,0}, {0,1}, {1,1}, {1,0}},
+};
+
+// Write the 4 vertices of face `face` of the du x dv rectangle of voxels whose minimum voxel is p
+// (in chunk-local coordinates). The UVs run from 0 to du and 0 to dv so the sprite repeats once per voxel.
+// shade holds the shading of the corners, in g_faceCorners order. Quads are drawn split along the
+// diagonal from their first vertex, so the corners are rotated when that would cut across the
+// occlusion gradient instead of along it.
+void WriteFace (VoxelVertex* out, glm::ivec3 const& p, int face, int du, int dv, int spid, uint32_t const (&shade)[4])
+{
+    int n_ax = g_faceNormalAxis[face], u_ax = g_faceUAxis[face], v_ax = g_faceVAxis[face];
+    glm::ivec3 base = p;
+    base[n_ax] += face & 1;
+    int first = (shade[0] & 3) + (shade[2] & 3) < (shade[1] & 3) + (shade[3] & 3) ? 1 : 0;
+    for(int i = 0; i < 4; ++i)
+    {
+        int c = (first + i) & 3;
+        int cu = g_faceCorners[face][c][0] * du;
+        int cv = g_faceCorners[face][c][1] * dv;
+        glm::ivec3 pos = base;
+        pos[u_ax] += cu;
+        pos[v_ax] += cv;
+        out[i] = VoxelVertex(pos.x, pos.y, pos.z, face, cu, cv, spid, shade[c]);
+    }
+}
+
+// Shading for meshes without lighting: every corner fully sunlit and unoccluded. The voxelizers
+// take any callable shade(local voxel, face, corners) that fills in the corner shading of a face,
+// see LightNeighbourhood in lighting.h.
+struct FlatShade
+{
+    void operator() (glm::ivec3 const&, int, uint32_t (&corners)[4]) const
+    {
+        std::fill_n(corners, 4, kFullShade);
+    }
+};
 
-    // We only voxelize interior voxels. Boundary voxels are slightly more complicated.
-    for(int z = 1; z < grid.Nz - 1; ++z)
+// Read access to a chunk and the voxels just outside of it, in chunk-local coordinates.
+struct ChunkView
+{
+    Voxels const& grid;
+    Chunk const& chunk;
+    glm::ivec3 origin;
+    Chunk const* neighbours[6]; // Face-adjacent chunks, by face index. Null if not allocated.
+
+    ChunkView (Voxels const& grid_, Chunk const& chunk_, glm::ivec3 const& key)
+        : grid(grid_), chunk(chunk_), origin{key * kChunkDim}
+    {
+        for(int face = 0; face < 6; ++face)
+        {
+            glm::ivec3 nb = key;
+            nb[g_faceNormalAxis[face]] += (face & 1) ? 1 : -1;
+            neighbours[face] = grid.FindChunk(nb);
+        }
+    }
+
+    // Coordinates outside of [0, kChunkDim) go through the neighbour chunks.
+    Block Get (int x, int y, int z) const
+    {
+        if(((x | y | z) & ~kChunkMask) == 0)
+            return chunk.Get(x, y, z);
+
+        // Exactly one axis just outside of the chunk: read the face neighbour directly.
+        int outside = ((x & ~kChunkMask) != 0) + ((y & ~kChunkMask) != 0) + ((z & ~kChunkMask) != 0);
+        if(outside == 1 && x >= -1 && x <= kChunkDim && y >= -1 && y <= kChunkDim && z >= -1 && z <= kChunkDim)
+        {
+            int face = x < 0 ? 0 : x == kChunkDim ? 1 : y < 0 ? 2 : y == kChunkDim ? 3 : z < 0 ? 4 : 5;
+            Chunk const* nb = neighbours[face];
+            return nb ? nb->Get(x & kChunkMask, y & kChunkMask, z & kChunkMask) : eAir;
+        }
+        return grid.Get(origin + glm::ivec3(x, y, z));
+    }
+
+    // Occupancy row (y, z). One of y and z may be a single step outside of the chunk.
+    uint32_t Row (int y, int z) const
+    {
+        Chunk const* c = &chunk;
+        if(y < 0) c = neighbours[2];
+        else if(y == kChunkDim) c = neighbours[3];
+        else if(z < 0) c = neighbours[4];
+        else if(z == kChunkDim) c = neighbours[5];
+        return c ? c->OccupancyRow(Chunk::RowIdx(y & kChunkMask, z & kChunkMask)) : 0;
+    }
+
+    // Bit x of faces[face] is set if face `face` of voxel (x, y, z) is exposed, i.e. the voxel
+    // is solid and its neighbour across that face is air. Uses only shifts and masks on the
+    // occupancy rows, so a whole row of 32 voxels is culled at once.
+    void ExposedFaceRow (int y, int z, uint32_t (&faces)[6]) const
     {
-        for(int y = 1; y < grid.Ny - 1; ++y)
+        uint32_t s = chunk.OccupancyRow(Chunk::RowIdx(y, z));
+        if(!s)
         {
-            for(int x = 1; x < grid.Nx - 1; ++x)
+            std::fill_n(faces, 6, 0u);
+            return;
+        }
+
+        int row = Chunk::RowIdx(y, z);
+        uint32_t left_edge = neighbours[0] ? neighbours[0]->OccupancyRow(row) >> (kChunkDim - 1) : 0;
+        uint32_t right_edge = neighbours[1] ? neighbours[1]->OccupancyRow(row) & 1u : 0;
+        uint32_t left = s << 1 | left_edge;                     // Occupancy of x - 1.
+        uint32_t right = s >> 1 | right_edge << (kChunkDim - 1); // Occupancy of x + 1.
+
+        faces[0] = s & ~left;
+        faces[1] = s & ~right;
+        faces[2] = s & ~Row(y - 1, z);
+        faces[3] = s & ~Row(y + 1, z);
+        faces[4] = s & ~Row(y, z - 1);
+        faces[5] = s & ~Row(y, z + 1);
+    }
+};
+
+// Call f(local voxel, face, sprite) for every exposed face of the voxels of a chunk with
+// local z in [z0, z1). Faces are visited in z, y, x, face order, which is the order in which
+// the voxelizers emit them.
+template <class F>
+void ForEachExposedFace (ChunkView const& view, int z0, int z1, F f)
+{
+    uint32_t faces[6];
+    for(int lz = z0; lz < z1; ++lz)
+    {
+        for(int ly = 0; ly < kChunkDim; ++ly)
+        {
+            view.ExposedFaceRow(ly, lz, faces);
+            uint32_t any = faces[0] | faces[1] | faces[2] | faces[3] | faces[4] | faces[5];
+            while(any)
             {
-                int idx = x + grid.Nx * (y + grid.Ny * z);
-                Block v{grid.data[idx]};
-                if(v == eAir)
-                    continue;
+                int lx = CountTrailingZeros(any);
+                any &= any - 1;
 
-                // Check X. 
-                if(grid.data[idx-1] == eAir) // Left 
-                {
-                    int spid = g_blockFaceSpriteLookup[v*6+0];
-                    points.emplace_back(x, y  , z  , -1, 0, 0, 0, 0, spid);
-                    points.emplace_back(x, y  , z+1, -1, 0, 0, 1, 0, spid);
-                    points.emplace_back(x, y+1, z+1, -1, 0, 0, 1, 1, spid);
-                    points.emplace_back(x, y+1, z  , -1, 0, 0, 0, 1, spid);
-                }
-                if(grid.data[idx+1] == eAir) // Right
-                {
-                    int spid = g_blockFaceSpriteLookup[v*6+1];
-                    points.emplace_back(x+1, y  , z  , 1, 0, 0, 0, 0, spid);
-                    points.emplace_back(x+1, y  , z+1, 1, 0, 0, 1, 0, spid);
-                    points.emplace_back(x+1, y+1, z+1, 1, 0, 0, 1, 1, spid);
-                    points.emplace_back(x+1, y+1, z  , 1, 0, 0, 0, 1, spid);
-                }
+                Block v{view.chunk.Get(lx, ly, lz)};
+                glm::ivec3 lp(lx, ly, lz);
+                for(int face = 0; face < 6; ++face)
+                    if(faces[face] >> lx & 1u)
+                        f(lp, face, g_blockFaceSpriteLookup[v*6+face]);
+            }
+        }
+    }
+}
 
-                // Check Y. 
-                if(grid.data[idx-grid.Nx] == eAir) // Bottom 
-                {
-                    int spid = g_blockFaceSpriteLookup[v*6+2];
-                    points.emplace_back(x  , y, z  , 0, -1, 0, 0, 0, spid); 
-                    points.emplace_back(x  , y, z+1, 0, -1, 0, 0, 1, spid); 
-                    points.emplace_back(x+1, y, z+1, 0, -1, 0, 1, 1, spid); 
-                    points.emplace_back(x+1, y, z  , 0, -1, 0, 1, 0, spid); 
-                }
-                if(grid.data[idx+grid.Nx] == eAir) // Top
-                {
-                    int spid = g_blockFaceSpriteLookup[v*6+3];
-                    points.emplace_back(x  , y+1, z  , 0, 1, 0, 0, 0, spid);
-                    points.emplace_back(x  , y+1, z+1, 0, 1, 0, 0, 1, spid);
-                    points.emplace_back(x+1, y+1, z+1, 0, 1, 0, 1, 1, spid);
-                    points.emplace_back(x+1, y+1, z  , 0, 1, 0, 1, 0, spid);
-                }
+// Append the mesh of a single chunk to points, one quad per exposed face. Vertex positions
+// are local to the chunk. Neighbouring chunks are consulted at the chunk border so faces
+// between chunks are culled correctly. Quads are drawn with a QuadIndexBuffer.
+template<class Shade = FlatShade>
+void VoxelizeChunk(Voxels const& grid, glm::ivec3 const& key, std::vector<VoxelVertex>& points, Shade const& shade = Shade())
+{
+    Chunk const* chunk = grid.FindChunk(key);
+    if(!chunk)
+        return;
+
+    uint32_t corners[4];
+    ForEachExposedFace(ChunkView(grid, *chunk, key), 0, kChunkDim, [&](glm::ivec3 const& lp, int face, int spid)
+    {
+        shade(lp, face, corners);
+        points.resize(points.size() + 4);
+        WriteFace(&points[points.size() - 4], lp, face, 1, 1, spid, corners);
+    });
+}
+
+// Same as VoxelizeChunk, but coplanar neighbouring faces with the same sprite are merged
+// into maximal rectangles (greedy meshing). Each merged quad has UVs spanning its size in
+// voxels so the sprite still tiles once per voxel. Only faces shaded the same at all four
+// corners are merged, since a merged quad can only interpolate between its own corners.
+template<class Shade = FlatShade>
+void VoxelizeChunkGreedy(Voxels const& grid, glm::ivec3 const& key, std::vector<VoxelVertex>& points, Shade const& shade = Shade())
+{
+    Chunk const* chunk = grid.FindChunk(key);
+    if(!chunk)
+        return;
+
+    ChunkView view(grid, *chunk, key);
+
+    // Exposed-face bits of every row, computed once with the bitmask kernel.
+    // Indexed by face * kChunkDim^2 + Chunk::RowIdx(y, z).
+    std::vector<uint32_t> face_rows(6 * kChunkDim * kChunkDim);
+    uint32_t faces[6];
+    for(int z = 0; z < kChunkDim; ++z)
+        for(int y = 0; y < kChunkDim; ++y)
+        {
+            view.ExposedFaceRow(y, z, faces);
+            for(int face = 0; face < 6; ++face)
+                face_rows[face * kChunkDim * kChunkDim + Chunk::RowIdx(y, z)] = faces[face];
+        }
 
-                // Check Z. 
-                if(grid.data[idx-grid.Nx*grid.Ny] == eAir) // Back
+    // Sprite and shading of each face in the current slice, indexed by u + kChunkDim * v. -1
+    // means no face. Faces that are shaded differently at their corners have kNoMerge set.
+    constexpr int kShadeShift = 10, kNoMerge = 1 << 30;
+    std::vector<int> mask(kChunkDim * kChunkDim);
+    uint32_t corners[4];
+    for(int face = 0; face < 6; ++face)
+    {
+        int n_ax = g_faceNormalAxis[face], u_ax = g_faceUAxis[face], v_ax = g_faceVAxis[face];
+        uint32_t const* rows = &face_rows[face * kChunkDim * kChunkDim];
+        for(int d = 0; d < kChunkDim; ++d)
+        {
+            glm::ivec3 lp;
+            lp[n_ax] = d;
+            for(int v = 0; v < kChunkDim; ++v)
+                for(int u = 0; u < kChunkDim; ++u)
                 {
-                    int spid = g_blockFaceSpriteLookup[v*6+4];
-                    points.emplace_back(x  , y  , z, 0, 0, -1, 0, 0, spid); 
-                    points.emplace_back(x  , y+1, z, 0, 0, -1, 0, 1, spid); 
-                    points.emplace_back(x+1, y+1, z, 0, 0, -1, 1, 1, spid); 
-                    points.emplace_back(x+1, y  , z, 0, 0, -1, 1, 0, spid); 
+                    lp[u_ax] = u;
+                    lp[v_ax] = v;
+                    int& m = mask[u + kChunkDim * v];
+                    if(!(rows[Chunk::RowIdx(lp.y, lp.z)] >> lp.x & 1u))
+                    {
+                        m = -1;
+                        continue;
+                    }
+                    shade(lp, face, corners);
+                    m = g_blockFaceSpriteLookup[chunk->Get(lp.x, lp.y, lp.z)*6+face] | int(corners[0]) << kShadeShift;
+                    if(std::any_of(corners + 1, corners + 4, [&](uint32_t c) {return c != corners[0];}))
+                        m |= kNoMerge;
                 }
-                if(grid.data[idx+grid.Nx*grid.Ny] == eAir) // Front
+
+            // Grow each unvisited face first along u, then along v while the whole row matches.
+            for(int v = 0; v < kChunkDim; ++v)
+            {
+                for(int u = 0; u < kChunkDim;)
                 {
-                    int spid = g_blockFaceSpriteLookup[v*6+5];
-                    points.emplace_back(x  , y  , z+1, 0, 0, 1, 0, 0, spid); 
-                    points.emplace_back(x  , y+1, z+1, 0, 0, 1, 0, 1, spid); 
-                    points.emplace_back(x+1, y+1, z+1, 0, 0, 1, 1, 1, spid); 
-                    points.emplace_back(x+1, y  , z+1, 0, 0, 1, 1, 0, spid); 
+                    int spid = mask[u + kChunkDim * v];
+                    if(spid < 0)
+                    {
+                        ++u;
+                        continue;
+                    }
+
+                    int du = 1, dv = 1;
+                    if(!(spid & kNoMerge))
+                    {
+                        while(u + du < kChunkDim && mask[u + du + kChunkDim * v] == spid)
+                            ++du;
+
+                        for(; v + dv < kChunkDim; ++dv)
+                        {
+                            int const* row = &mask[u + kChunkDim * (v + dv)];
+                            if(std::any_of(row, row + du, [spid](int s) {return s != spid;}))
+                                break;
+                        }
+                    }
+
+                    for(int j = 0; j < dv; ++j)
+                        std::fill_n(&mask[u + kChunkDim * (v + j)], du, -1);
+
+                    lp[u_ax] = u;
+                    lp[v_ax] = v;
+                    shade(lp, face, corners);
+                    points.resize(points.size() + 4);
+                    WriteFace(&points[points.size() - 4], lp, face, du, dv, spid & ((1 << kShadeShift) - 1), corners);
+                    u += du;
                 }
             }
         }
     }
+}
 
-    // Indices are the same for each square.
-    int inds_single[6]{0, 1, 2, 2, 3, 0};
-    for(size_t i = 0; i < points.size() / 4; ++i)
-    {
-        indices.insert(indices.end(), inds_single, inds_single + 6);
-        for(int& i: inds_single)
-            i += 4;
-    }
+// Replace points with the mesh of one chunk, shaded by shade (see FlatShade).
+template<class Shade = FlatShade>
+void Voxelize(Voxels const& grid, glm::ivec3 const& key, std::vector<VoxelVertex>& points, bool greedy = false, Shade const& shade = Shade())
+{
+    // Note that resize to zero does not change capacity. Therefore,
+    // although we call emplace_back a bunch here, if we run this function
+    // a lot, the emplace_back will be constant time.
+    points.resize(0);
+    if(greedy)
+        VoxelizeChunkGreedy(grid, key, points, shade);
+    else
+        VoxelizeChunk(grid, key, points, shade);
 }
 
 //static uint16_t edgeTable[256]{
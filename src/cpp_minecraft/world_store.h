@@ -0,0 +1,504 @@
+#pragma once
+
+#include "voxels.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Chunks are saved in region files of kRegionDim^3 chunks each, named
+// <prefix>.<rx>.<ry>.<rz>.vxr. A region file starts with a fixed header and offset table
+// with one entry per chunk, followed by the chunk blobs. Each blob is given a capacity
+// rounded up to kRegionSector bytes, so a chunk that is saved again usually overwrites its
+// old blob in place; one that outgrew it is appended at the end of the file.
+// All values are stored in the byte order of the machine (little endian on every target
+// we build for).
+constexpr int kRegionBits = 3;
+constexpr int kRegionDim = 1 << kRegionBits;
+constexpr int kRegionMask = kRegionDim - 1;
+constexpr int kRegionChunks = kRegionDim * kRegionDim * kRegionDim;
+constexpr uint32_t kRegionSector = 4096;
+constexpr char kRegionMagic[4] = {'V', 'X', 'R', '1'};
+
+struct RegionEntry
+{
+    uint32_t offset;
+    uint32_t size;     // 0 if the chunk is not stored, i.e. it is all air.
+    uint32_t capacity; // Space reserved at offset, kept when the chunk is removed.
+};
+
+// Magic, then the table. Blobs start at the first sector after it.
+constexpr uint32_t kRegionTableOffset = sizeof(kRegionMagic);
+constexpr uint32_t kRegionDataOffset =
+    (kRegionTableOffset + kRegionChunks * sizeof(RegionEntry) + kRegionSector - 1) / kRegionSector * kRegionSector;
+
+// Fixed part of a chunk blob. It is followed by the palette, padded to 4 bytes, then by the
+// packed indices and the occupancy rows as 32 bit words, either raw or, if that is smaller,
+// as (run length, word) pairs.
+struct ChunkBlobHeader
+{
+    uint8_t palette_size;
+    uint8_t bits;
+    uint8_t log_bits;
+    uint8_t flags;
+    int32_t solid_count;
+    uint32_t num_words;   // Number of words once decoded.
+    uint32_t num_stored;  // Number of words stored.
+    uint64_t bricks[kChunkBricks];
+};
+constexpr uint8_t kBlobRle = 1;
+constexpr uint8_t kBlobOccupancy = 2;
+
+void WriteChunkBlob (Chunk const& chunk, std::vector<uint8_t>& out)
+{
+    ChunkBlobHeader h;
+    h.palette_size = chunk.palette.size();
+    h.bits = chunk.bits;
+    h.log_bits = chunk.log_bits;
+    h.flags = chunk.occupancy.empty() ? 0 : kBlobOccupancy;
+    h.solid_count = chunk.solid_count;
+    h.num_words = chunk.indices.size() + chunk.occupancy.size();
+    std::memcpy(h.bricks, chunk.bricks, sizeof(h.bricks));
+
+    std::vector<uint32_t> words(chunk.indices);
+    words.insert(words.end(), chunk.occupancy.begin(), chunk.occupancy.end());
+    std::vector<uint32_t> runs;
+    for(size_t i = 0; i < words.size() && runs.size() < words.size();)
+    {
+        size_t j = i + 1;
+        while(j < words.size() && words[j] == words[i])
+            ++j;
+        runs.push_back(j - i);
+        runs.push_back(words[i]);
+        i = j;
+    }
+    if(runs.size() < words.size())
+    {
+        h.flags |= kBlobRle;
+        words.swap(runs);
+    }
+    h.num_stored = words.size();
+
+    size_t palette_bytes = (chunk.palette.size() + 3) & ~size_t(3);
+    out.assign(sizeof(h) + palette_bytes + words.size() * sizeof(uint32_t), 0);
+    std::memcpy(&out[0], &h, sizeof(h));
+    std::memcpy(&out[sizeof(h)], chunk.palette.data(), chunk.palette.size());
+    if(!words.empty())
+        std::memcpy(&out[sizeof(h) + palette_bytes], words.data(), words.size() * sizeof(uint32_t));
+}
+
+// Returns false if the blob is malformed, so that a corrupt or foreign file cannot produce a
+// chunk whose reads go out of bounds. Raw blobs are copied straight out of the mapping.
+bool ReadChunkBlob (uint8_t const* data, size_t size, Chunk& chunk)
+{
+    ChunkBlobHeader h;
+    if(size < sizeof(h))
+        return false;
+    std::memcpy(&h, data, sizeof(h));
+    size_t palette_bytes = (h.palette_size + 3) & ~size_t(3);
+    if(h.palette_size == 0 || size < sizeof(h) + palette_bytes + size_t(h.num_stored) * sizeof(uint32_t))
+        return false;
+
+    // A uniform chunk has bits == 0 and a single palette entry; otherwise 1, 2, 4 or 8 bits per
+    // voxel with room for every palette entry, and occupancy rows.
+    if(h.bits == 0 ? h.log_bits != 0 || h.palette_size != 1
+                   : h.log_bits > 3 || h.bits != 1 << h.log_bits || h.palette_size > 1u << h.bits
+                     || !(h.flags & kBlobOccupancy))
+        return false;
+    if(h.solid_count < 0 || h.solid_count > kChunkVol)
+        return false;
+    Block const* palette = reinterpret_cast<Block const*>(data + sizeof(h));
+    for(int i = 0; i < h.palette_size; ++i)
+        if(palette[i] >= eCount)
+            return false;
+
+    size_t num_indices = h.bits ? kChunkVol >> (5 - h.log_bits) : 0;
+    size_t num_occupancy = (h.flags & kBlobOccupancy) ? kChunkDim * kChunkDim : 0;
+    if(h.num_words != num_indices + num_occupancy)
+        return false;
+
+    chunk.palette.assign(palette, palette + h.palette_size);
+    chunk.bits = h.bits;
+    chunk.log_bits = h.log_bits;
+    chunk.solid_count = h.solid_count;
+    std::memcpy(chunk.bricks, h.bricks, sizeof(h.bricks));
+
+    chunk.indices.resize(num_indices);
+    chunk.occupancy.resize(num_occupancy);
+    uint8_t const* stored = data + sizeof(h) + palette_bytes;
+    if(h.flags & kBlobRle)
+    {
+        size_t n = 0;
+        for(uint32_t i = 0; i + 1 < h.num_stored; i += 2)
+        {
+            uint32_t run, word;
+            std::memcpy(&run, stored + i * sizeof(uint32_t), sizeof(run));
+            std::memcpy(&word, stored + (i + 1) * sizeof(uint32_t), sizeof(word));
+            if(n + run > h.num_words)
+                return false;
+            for(size_t end = n + run; n < end; ++n)
+                (n < num_indices ? chunk.indices[n] : chunk.occupancy[n - num_indices]) = word;
+        }
+        if(n != h.num_words)
+            return false;
+    }
+    else if(h.num_stored != h.num_words)
+        return false;
+    else
+    {
+        if(num_indices)
+            std::memcpy(chunk.indices.data(), stored, num_indices * sizeof(uint32_t));
+        if(num_occupancy)
+            std::memcpy(chunk.occupancy.data(), stored + num_indices * sizeof(uint32_t), num_occupancy * sizeof(uint32_t));
+    }
+
+    // Every index must name a palette entry, unless the palette fills the index width.
+    if(h.bits && h.palette_size < 1u << h.bits)
+    {
+        int per_word = 32 >> h.log_bits;
+        uint32_t mask = (1u << h.bits) - 1;
+        for(uint32_t word: chunk.indices)
+            for(int i = 0; i < per_word; ++i)
+                if((word >> (i << h.log_bits) & mask) >= h.palette_size)
+                    return false;
+    }
+    return true;
+}
+
+// One region file. Reads go through a read-only memory mapping of the file (a plain copy of
+// it on Windows), writes through stdio. Not thread safe; WorldStore serializes access.
+class RegionFile
+{
+private:
+    std::string path_;
+    FILE* file_ = nullptr;          // Open for writing once the first chunk is saved.
+    bool exists_ = false;
+    size_t file_size_ = 0;
+    RegionEntry table_[kRegionChunks];
+
+    uint8_t const* map_ = nullptr;
+    size_t map_size_ = 0;           // Remapped when the file has grown past it.
+    bool map_stale_ = false;        // The copy no longer matches the file.
+#ifdef _WIN32
+    std::vector<uint8_t> copy_;
+#endif
+
+public:
+    explicit RegionFile (std::string const& path)
+        : path_{path}
+    {
+        std::memset(table_, 0, sizeof(table_));
+        Map();
+        if(!map_ || map_size_ < kRegionDataOffset || std::memcmp(map_, kRegionMagic, sizeof(kRegionMagic)) != 0)
+        {
+            if(map_)
+                std::cerr << "Ignoring invalid region file " << path_ << std::endl;
+            Unmap();
+            return;
+        }
+        exists_ = true;
+        file_size_ = map_size_;
+        std::memcpy(table_, map_ + kRegionTableOffset, sizeof(table_));
+    }
+
+    ~RegionFile ()
+    {
+        Unmap();
+        if(file_)
+            fclose(file_);
+    }
+
+    RegionFile (RegionFile const&) = delete;
+    RegionFile& operator= (RegionFile const&) = delete;
+
+    static int Slot (glm::ivec3 const& key)
+    {
+        return (key.x & kRegionMask) + kRegionDim * ((key.y & kRegionMask) + kRegionDim * (key.z & kRegionMask));
+    }
+
+    // Returns false if the chunk is not stored or its blob is malformed.
+    bool Read (glm::ivec3 const& key, Chunk& chunk)
+    {
+        RegionEntry const& e = table_[Slot(key)];
+        if(!exists_ || e.size == 0)
+            return false;
+        if(map_stale_ || map_size_ < file_size_)
+            Map();
+        if(e.offset > map_size_ || e.size > map_size_ - e.offset)
+            return false;
+        if(ReadChunkBlob(map_ + e.offset, e.size, chunk))
+            return true;
+        // Leave an all air chunk behind, which the streamer can generate into.
+        std::cerr << "Ignoring malformed chunk " << key.x << " " << key.y << " " << key.z << " in " << path_ << std::endl;
+        chunk = Chunk();
+        return false;
+    }
+
+    // Store the blob of the chunk, or mark the chunk as not stored if blob is empty.
+    bool Write (glm::ivec3 const& key, std::vector<uint8_t> const& blob)
+    {
+        if(!OpenForWriting())
+            return false;
+
+        int slot = Slot(key);
+        RegionEntry& e = table_[slot];
+        e.size = blob.size();
+        if(!blob.empty())
+        {
+            if(blob.size() > e.capacity)
+            {
+                e.offset = file_size_;
+                e.capacity = (blob.size() + kRegionSector - 1) / kRegionSector * kRegionSector;
+                file_size_ += e.capacity;
+            }
+
+            std::vector<uint8_t> padded(blob);
+            padded.resize(e.capacity, 0);
+            if(fseek(file_, e.offset, SEEK_SET) != 0 || fwrite(padded.data(), 1, padded.size(), file_) != padded.size())
+                return false;
+        }
+        if(fseek(file_, kRegionTableOffset + slot * sizeof(RegionEntry), SEEK_SET) != 0
+        || fwrite(&e, sizeof(e), 1, file_) != 1)
+            return false;
+#ifdef _WIN32
+        map_stale_ = true;
+#endif
+        return fflush(file_) == 0;
+    }
+
+private:
+    bool OpenForWriting ()
+    {
+        if(file_)
+            return true;
+        if(exists_)
+        {
+            file_ = fopen(path_.c_str(), "r+b");
+            return file_ != nullptr;
+        }
+
+        file_ = fopen(path_.c_str(), "w+b");
+        if(!file_)
+            return false;
+        std::vector<uint8_t> header(kRegionDataOffset, 0);
+        std::memcpy(&header[0], kRegionMagic, sizeof(kRegionMagic));
+        std::memcpy(&header[kRegionTableOffset], table_, sizeof(table_));
+        if(fwrite(header.data(), 1, header.size(), file_) != header.size())
+            return false;
+        exists_ = true;
+        file_size_ = kRegionDataOffset;
+        return fflush(file_) == 0;
+    }
+
+    void Map ()
+    {
+        Unmap();
+        map_stale_ = false;
+#ifdef _WIN32
+        FILE* f = fopen(path_.c_str(), "rb");
+        if(!f)
+            return;
+        fseek(f, 0, SEEK_END);
+        copy_.resize(ftell(f));
+        fseek(f, 0, SEEK_SET);
+        copy_.resize(fread(copy_.data(), 1, copy_.size(), f));
+        fclose(f);
+        map_ = copy_.data();
+        map_size_ = copy_.size();
+#else
+        int fd = open(path_.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(p != MAP_FAILED)
+            {
+                map_ = static_cast<uint8_t const*>(p);
+                map_size_ = st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    void Unmap ()
+    {
+#ifdef _WIN32
+        copy_.clear();
+#else
+        if(map_)
+            munmap(const_cast<uint8_t*>(map_), map_size_);
+#endif
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+};
+
+// Loads and saves the chunks of a Voxels in region files. Saves are incremental and run on a
+// background thread: SaveAsync copies the chunks changed since the last save, which is cheap
+// with palette storage, and returns right away.
+class WorldStore
+{
+private:
+    std::string prefix_;
+    std::unordered_map<glm::ivec3, std::unique_ptr<RegionFile>, ChunkHash> regions_;
+    std::mutex io_mutex_;           // Guards regions_ and the files.
+
+    // Chunks waiting to be written. A chunk that was freed is written as all air, so that a
+    // streamed world knows not to generate it again.
+    std::vector<std::pair<glm::ivec3, std::unique_ptr<Chunk>>> pending_;
+    // The chunks the saver is writing now. Only changed under pending_mutex_, and only read
+    // while it is not changing.
+    std::vector<std::pair<glm::ivec3, std::unique_ptr<Chunk>>> writing_jobs_;
+    std::mutex pending_mutex_;
+    std::condition_variable pending_cv_;
+    bool writing_ = false;
+    bool stop_ = false;
+    std::thread saver_;
+
+public:
+    explicit WorldStore (std::string const& prefix)
+        : prefix_{prefix}, saver_{&WorldStore::SaveLoop, this}
+    {}
+
+    // Writes whatever is still pending before returning.
+    ~WorldStore ()
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            stop_ = true;
+        }
+        pending_cv_.notify_all();
+        saver_.join();
+    }
+
+    static glm::ivec3 RegionOf (glm::ivec3 const& key)
+    {
+        return {key.x >> kRegionBits, key.y >> kRegionBits, key.z >> kRegionBits};
+    }
+
+    // Returns false if the chunk is not stored. A chunk that is queued for saving, e.g. one just
+    // evicted from the grid, is served from the queue, since the file does not have it yet.
+    bool LoadChunk (glm::ivec3 const& key, Chunk& chunk)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            // The latest copy wins: pending_ was queued after the jobs being written.
+            for(auto const* jobs: {&pending_, &writing_jobs_})
+                for(auto it = jobs->rbegin(); it != jobs->rend(); ++it)
+                    if(it->first == key)
+                    {
+                        chunk = *it->second;
+                        return true;
+                    }
+        }
+        std::lock_guard<std::mutex> lock(io_mutex_);
+        return Region(RegionOf(key)).Read(key, chunk);
+    }
+
+    // The seed of the world's terrain, kept in <prefix>.seed so that chunks generated in later
+    // runs line up with the saved ones. A new world takes new_seed.
+    uint32_t LoadOrCreateSeed (uint32_t new_seed)
+    {
+        std::lock_guard<std::mutex> lock(io_mutex_);
+        std::string path = prefix_ + ".seed";
+        if(FILE* f = std::fopen(path.c_str(), "r"))
+        {
+            unsigned seed;
+            bool ok = std::fscanf(f, "%u", &seed) == 1;
+            std::fclose(f);
+            if(ok)
+                return seed;
+        }
+        if(FILE* f = std::fopen(path.c_str(), "w"))
+        {
+            std::fprintf(f, "%u\n", unsigned(new_seed));
+            std::fclose(f);
+        }
+        else
+            std::cerr << "Failed to save the world seed to " << path << std::endl;
+        return new_seed;
+    }
+
+    // Queue the chunks of grid.unsaved_chunks for writing and clear the set.
+    void SaveAsync (Voxels& grid)
+    {
+        if(grid.unsaved_chunks.empty())
+            return;
+        std::vector<std::pair<glm::ivec3, std::unique_ptr<Chunk>>> snapshot;
+        snapshot.reserve(grid.unsaved_chunks.size());
+        for(auto const& key: grid.unsaved_chunks)
+        {
+            Chunk const* c = grid.FindChunk(key);
+            snapshot.emplace_back(key, std::unique_ptr<Chunk>(c ? new Chunk(*c) : new Chunk));
+        }
+        grid.unsaved_chunks.clear();
+
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            for(auto& job: snapshot)
+                pending_.push_back(std::move(job));
+        }
+        pending_cv_.notify_all();
+    }
+
+    // Block until everything queued so far has been written.
+    void Flush ()
+    {
+        std::unique_lock<std::mutex> lock(pending_mutex_);
+        pending_cv_.wait(lock, [this] {return pending_.empty() && !writing_;});
+    }
+
+private:
+    RegionFile& Region (glm::ivec3 const& region)
+    {
+        auto& file = regions_[region];
+        if(!file)
+            file.reset(new RegionFile(prefix_ + "." + std::to_string(region.x) + "." + std::to_string(region.y)
+                                      + "." + std::to_string(region.z) + ".vxr"));
+        return *file;
+    }
+
+    void SaveLoop ()
+    {
+        std::vector<uint8_t> blob;
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(pending_mutex_);
+                // Written, so loads can read these chunks from the files again.
+                writing_jobs_.clear();
+                writing_ = false;
+                pending_cv_.notify_all();
+                pending_cv_.wait(lock, [this] {return stop_ || !pending_.empty();});
+                if(pending_.empty())
+                    return;
+                writing_jobs_.swap(pending_);
+                writing_ = true;
+            }
+
+            for(auto const& job: writing_jobs_)
+            {
+                WriteChunkBlob(*job.second, blob);
+                std::lock_guard<std::mutex> lock(io_mutex_);
+                if(!Region(RegionOf(job.first)).Write(job.first, blob))
+                    std::cerr << "Failed to save chunk " << job.first.x << " " << job.first.y << " " << job.first.z << std::endl;
+            }
+        }
+    }
+};